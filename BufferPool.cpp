@@ -0,0 +1,217 @@
+#include "BufferPool.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+namespace cocos2d
+{
+    namespace network
+    {
+        namespace
+        {
+            const uint32_t LARGE_CLASS = 0xFFFFFFFFu;
+
+            struct BlockHeader {
+                BlockHeader *next;      //link while parked in a free list
+                uint32_t cls;
+            };
+
+            //keep payloads 16 bytes aligned
+            const size_t HEADER_SIZE = 16;
+            static_assert(sizeof(BlockHeader) <= HEADER_SIZE, "block header too large");
+
+            inline size_t blockSizeOf(int cls) { return (size_t)1 << (BUFFER_POOL_MIN_SHIFT + cls); }
+            inline BlockHeader *headerOf(void *p) { return (BlockHeader*)((uint8_t*)p - HEADER_SIZE); }
+            inline void *payloadOf(BlockHeader *h) { return (uint8_t*)h + HEADER_SIZE; }
+
+            //only the owning thread writes, so a plain load/store keeps the counter off the bus
+            inline void bump(std::atomic<uint64_t> &c) { c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        }
+
+        struct BufferPool::ThreadCache {
+            BlockHeader *blocks[BUFFER_POOL_CLASS_COUNT][BUFFER_POOL_THREAD_CACHE_SIZE];
+            size_t count[BUFFER_POOL_CLASS_COUNT] = {};
+            std::atomic<uint64_t> hits[BUFFER_POOL_CLASS_COUNT];
+            std::atomic<uint64_t> misses[BUFFER_POOL_CLASS_COUNT];
+
+            ThreadCache()
+            {
+                for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+                {
+                    hits[i].store(0, std::memory_order_relaxed);
+                    misses[i].store(0, std::memory_order_relaxed);
+                }
+                BufferPool &pool = BufferPool::getInstance();
+                std::lock_guard<std::mutex> guard(pool._cachesMutex);
+                pool._caches.push_back(this);
+            }
+
+            ~ThreadCache()
+            {
+                BufferPool::getInstance().retire(this);
+            }
+        };
+
+        BufferPool &BufferPool::getInstance()
+        {
+            //never destroyed, thread caches may outlive static destructors on exit
+            static BufferPool *pool = new BufferPool();
+            return *pool;
+        }
+
+        BufferPool::ThreadCache &BufferPool::localCache()
+        {
+            static thread_local ThreadCache cache;
+            return cache;
+        }
+
+        int BufferPool::classOf(size_t size)
+        {
+            if (size > ((size_t)1 << BUFFER_POOL_MAX_SHIFT)) return -1;
+            int cls = 0;
+            while (blockSizeOf(cls) < size) cls++;
+            return cls;
+        }
+
+        size_t BufferPool::blockSize(size_t size)
+        {
+            int cls = classOf(size);
+            return cls < 0 ? size : blockSizeOf(cls);
+        }
+
+        void *BufferPool::acquire(size_t size)
+        {
+            int cls = classOf(size);
+            if (cls < 0)
+            {
+                _largeAllocs.fetch_add(1, std::memory_order_relaxed);
+                BlockHeader *h = (BlockHeader*)malloc(HEADER_SIZE + size);
+                if (!h) return nullptr;
+                h->cls = LARGE_CLASS;
+                return payloadOf(h);
+            }
+
+            ThreadCache &cache = localCache();
+            BlockHeader *h = nullptr;
+            if (cache.count[cls] > 0)
+                h = cache.blocks[cls][--cache.count[cls]];
+            else
+                h = (BlockHeader*)refill(cache, cls);
+
+            if (h)
+            {
+                bump(cache.hits[cls]);
+            }
+            else
+            {
+                bump(cache.misses[cls]);
+                h = (BlockHeader*)malloc(HEADER_SIZE + blockSizeOf(cls));
+                if (!h) return nullptr;
+                h->cls = (uint32_t)cls;
+            }
+            return payloadOf(h);
+        }
+
+        void BufferPool::release(void *p)
+        {
+            if (!p) return;
+            BlockHeader *h = headerOf(p);
+            if (h->cls == LARGE_CLASS)
+            {
+                free(h);
+                return;
+            }
+
+            int cls = (int)h->cls;
+            ThreadCache &cache = localCache();
+            if (cache.count[cls] == BUFFER_POOL_THREAD_CACHE_SIZE)
+                getInstance().flush(cache, cls, BUFFER_POOL_THREAD_CACHE_SIZE / 2);
+            cache.blocks[cls][cache.count[cls]++] = h;
+        }
+
+        void *BufferPool::refill(ThreadCache &cache, int cls)
+        {
+            SharedList &shared = _shared[cls];
+            std::lock_guard<std::mutex> guard(shared.mtx);
+            if (!shared.head) return nullptr;
+
+            BlockHeader *first = (BlockHeader*)shared.head;
+            shared.head = first->next;
+            shared.count--;
+
+            //pull half a cache worth in one go
+            while (shared.head && cache.count[cls] < BUFFER_POOL_THREAD_CACHE_SIZE / 2)
+            {
+                BlockHeader *h = (BlockHeader*)shared.head;
+                shared.head = h->next;
+                shared.count--;
+                cache.blocks[cls][cache.count[cls]++] = h;
+            }
+            return first;
+        }
+
+        void BufferPool::flush(ThreadCache &cache, int cls, size_t keep)
+        {
+            if (cache.count[cls] <= keep) return;
+
+            const size_t limit = std::max<size_t>(1, BUFFER_POOL_SHARED_LIMIT_BYTES / blockSizeOf(cls));
+            SharedList &shared = _shared[cls];
+            std::lock_guard<std::mutex> guard(shared.mtx);
+            while (cache.count[cls] > keep)
+            {
+                BlockHeader *h = cache.blocks[cls][--cache.count[cls]];
+                if (shared.count >= limit)
+                {
+                    free(h);
+                    continue;
+                }
+                h->next = (BlockHeader*)shared.head;
+                shared.head = h;
+                shared.count++;
+            }
+        }
+
+        void BufferPool::retire(ThreadCache *cache)
+        {
+            for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+                flush(*cache, i, 0);
+
+            std::lock_guard<std::mutex> guard(_cachesMutex);
+            for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+            {
+                _retiredHits[i] += cache->hits[i].load(std::memory_order_relaxed);
+                _retiredMisses[i] += cache->misses[i].load(std::memory_order_relaxed);
+            }
+            _caches.erase(std::remove(_caches.begin(), _caches.end(), cache), _caches.end());
+        }
+
+        BufferPool::Stats BufferPool::stats()
+        {
+            Stats s;
+            s.hits = 0;
+            s.misses = 0;
+            s.largeAllocs = _largeAllocs.load(std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> guard(_cachesMutex);
+            for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+            {
+                ClassStats &c = s.classes[i];
+                c.blockSize = blockSizeOf(i);
+                c.hits = _retiredHits[i];
+                c.misses = _retiredMisses[i];
+                for (auto *cache : _caches)
+                {
+                    c.hits += cache->hits[i].load(std::memory_order_relaxed);
+                    c.misses += cache->misses[i].load(std::memory_order_relaxed);
+                }
+                {
+                    std::lock_guard<std::mutex> sguard(_shared[i].mtx);
+                    c.idleShared = _shared[i].count;
+                }
+                s.hits += c.hits;
+                s.misses += c.misses;
+            }
+            return s;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// smallest and largest pooled block, payload sizes include the LWS_PRE headroom.
+// the largest class holds a full WS_RX_BUFFER_SIZE frame plus headroom, bigger requests
+// take the large-object path and go straight to malloc/free.
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 17
+#define BUFFER_POOL_CLASS_COUNT (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+
+// blocks kept per size class in each thread's cache, half of them move to/from the shared list at once
+#define BUFFER_POOL_THREAD_CACHE_SIZE 64
+// upper bound of idle bytes per size class in the shared list, the rest is returned to the system
+#define BUFFER_POOL_SHARED_LIMIT_BYTES (4 << 20)
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * Thread-safe size-classed allocator for message payloads.
+         * Each thread owns a small cache per class, so acquire/release usually touch no shared state;
+         * blocks freed on another thread (e.g. allocated by the app, freed by the net thread)
+         * travel back through a per-class shared list in batches.
+         */
+        class BufferPool
+        {
+        public:
+            struct ClassStats {
+                size_t blockSize;
+                uint64_t hits;      //served from a thread cache or the shared list
+                uint64_t misses;    //had to malloc a new block
+                size_t idleShared;  //blocks parked in the shared list
+            };
+
+            struct Stats {
+                ClassStats classes[BUFFER_POOL_CLASS_COUNT];
+                uint64_t hits;
+                uint64_t misses;
+                uint64_t largeAllocs;   //requests above the largest class
+            };
+
+            static BufferPool &getInstance();
+
+            void *acquire(size_t size);
+            static void release(void *p);
+            // usable bytes of the block acquire(size) would return
+            static size_t blockSize(size_t size);
+
+            Stats stats();
+
+        private:
+            struct ThreadCache;
+            struct SharedList {
+                std::mutex mtx;
+                void *head = nullptr;
+                size_t count = 0;
+            };
+
+            BufferPool() {}
+            BufferPool(const BufferPool &) = delete;
+
+            static ThreadCache &localCache();
+            static int classOf(size_t size);
+
+            void *refill(ThreadCache &cache, int cls);
+            void flush(ThreadCache &cache, int cls, size_t keep);
+            void retire(ThreadCache *cache);
+
+            SharedList _shared[BUFFER_POOL_CLASS_COUNT];
+
+            std::mutex _cachesMutex;
+            std::vector<ThreadCache*> _caches;
+            uint64_t _retiredHits[BUFFER_POOL_CLASS_COUNT] = {};
+            uint64_t _retiredMisses[BUFFER_POOL_CLASS_COUNT] = {};
+            std::atomic<uint64_t> _largeAllocs{ 0 };
+        };
+
+        /**
+         * std allocator on top of BufferPool, used with std::allocate_shared
+         * so control block and object come from the pool too.
+         */
+        template<typename T>
+        class PoolAllocator
+        {
+        public:
+            typedef T value_type;
+
+            PoolAllocator() {}
+            template<typename U>
+            PoolAllocator(const PoolAllocator<U> &) {}
+
+            T *allocate(size_t n) { return static_cast<T*>(BufferPool::getInstance().acquire(n * sizeof(T))); }
+            void deallocate(T *p, size_t) { BufferPool::release(p); }
+
+            template<typename U>
+            bool operator==(const PoolAllocator<U> &) const { return true; }
+            template<typename U>
+            bool operator!=(const PoolAllocator<U> &) const { return false; }
+        };
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// number of independently locked shards, a power of two
+#define CONNECTION_REGISTRY_SHARDS 64
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * Thread-safe map from connection id to connection.
+         * Ids are spread over CONNECTION_REGISTRY_SHARDS maps, each behind its own mutex, so
+         * concurrent inserts/erases rarely contend; size() is a single atomic load.
+         * forEach() visits a snapshot and runs the callback with no lock held.
+         */
+        template<typename T>
+        class ConnectionRegistry
+        {
+        public:
+            typedef std::shared_ptr<T> Ptr;
+
+            void insert(int64_t id, const Ptr &conn)
+            {
+                Shard &shard = shardOf(id);
+                std::lock_guard<std::mutex> guard(shard.mtx);
+                if (shard.map.emplace(id, conn).second)
+                    _size.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            bool erase(int64_t id)
+            {
+                Ptr removed;    //released after unlocking, its destructor may erase again
+                {
+                    Shard &shard = shardOf(id);
+                    std::lock_guard<std::mutex> guard(shard.mtx);
+                    auto it = shard.map.find(id);
+                    if (it == shard.map.end()) return false;
+                    removed = std::move(it->second);
+                    shard.map.erase(it);
+                }
+                _size.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            Ptr find(int64_t id)
+            {
+                Shard &shard = shardOf(id);
+                std::lock_guard<std::mutex> guard(shard.mtx);
+                auto it = shard.map.find(id);
+                return it == shard.map.end() ? nullptr : it->second;
+            }
+
+            size_t size() const { return _size.load(std::memory_order_relaxed); }
+
+            // connections registered while forEach runs may or may not be visited
+            template<typename Fn>
+            void forEach(Fn &&fn)
+            {
+                std::vector<Ptr> snapshot;
+                snapshot.reserve(size());
+                for (auto &shard : _shards)
+                {
+                    std::lock_guard<std::mutex> guard(shard.mtx);
+                    for (auto &kv : shard.map)
+                        snapshot.push_back(kv.second);
+                }
+                for (auto &conn : snapshot)
+                    fn(conn);
+            }
+
+        private:
+            struct alignas(64) Shard {
+                std::mutex mtx;
+                std::unordered_map<int64_t, Ptr> map;
+            };
+
+            Shard &shardOf(int64_t id)
+            {
+                //ids come from a counter, the low bits alone spread them evenly
+                return _shards[(uint64_t)id & (CONNECTION_REGISTRY_SHARDS - 1)];
+            }
+
+            Shard _shards[CONNECTION_REGISTRY_SHARDS];
+            std::atomic<size_t> _size{ 0 };
+        };
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+#include "BufferPool.h"
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * Unbounded multi-producer/single-consumer queue (Vyukov's intrusive design).
+         * Linking a node is a single atomic exchange with no retry loop. The node itself comes from
+         * BufferPool, which is lock-free only while the calling thread's cache has a block; a refill
+         * takes the size class's shared-list mutex and a cold pool falls back to malloc.
+         * pop() must only be called from the consumer thread; it may briefly report empty
+         * while a producer is between its exchange and its link, so producers should
+         * wake the consumer after push() returns.
+         */
+        template<typename T>
+        class MpscQueue
+        {
+        public:
+            MpscQueue()
+            {
+                Node *stub = newNode(T());
+                _head.store(stub, std::memory_order_relaxed);
+                _tail = stub;
+            }
+
+            ~MpscQueue()
+            {
+                T drop;
+                while (pop(drop)) {}
+                deleteNode(_tail);
+            }
+
+            MpscQueue(const MpscQueue &) = delete;
+            MpscQueue &operator=(const MpscQueue &) = delete;
+
+            void push(T &&value)
+            {
+                Node *n = newNode(std::move(value));
+                Node *prev = _head.exchange(n, std::memory_order_acq_rel);
+                prev->next.store(n, std::memory_order_release);
+            }
+
+            void push(const T &value)
+            {
+                T copy(value);
+                push(std::move(copy));
+            }
+
+            bool pop(T &out)
+            {
+                Node *tail = _tail;
+                Node *next = tail->next.load(std::memory_order_acquire);
+                if (!next) return false;
+                out = std::move(next->value);
+                _tail = next;
+                deleteNode(tail);
+                return true;
+            }
+
+            bool empty() const
+            {
+                return _tail->next.load(std::memory_order_acquire) == nullptr;
+            }
+
+        private:
+            struct Node {
+                explicit Node(T &&v) :value(std::move(v)) {}
+                std::atomic<Node*> next{ nullptr };
+                T value;
+            };
+
+            static Node *newNode(T &&v)
+            {
+                void *mem = BufferPool::getInstance().acquire(sizeof(Node));
+                return new (mem) Node(std::move(v));
+            }
+
+            static void deleteNode(Node *n)
+            {
+                n->~Node();
+                BufferPool::release(n);
+            }
+
+            std::atomic<Node*> _head;
+            Node *_tail;
+        };
+    }
+}
@@ -0,0 +1,65 @@
+#include "UIDispatcher.h"
+
+namespace cocos2d
+{
+    namespace network
+    {
+        UIDispatcher &UIDispatcher::getInstance()
+        {
+            //never destroyed, the net thread may still post while static destructors run
+            static UIDispatcher *dispatcher = new UIDispatcher();
+            return *dispatcher;
+        }
+
+        void UIDispatcher::setWakeup(const std::function<void()> &wakeup)
+        {
+            auto hook = wakeup ? std::make_shared<std::function<void()>>(wakeup) : nullptr;
+            std::atomic_store(&_wakeup, hook);
+            //tasks may already be waiting for a drain nobody scheduled
+            if (hook && _pending.load() > 0)
+            {
+                _wakePending.store(false);
+                wake();
+            }
+        }
+
+        void UIDispatcher::post(Task &&task)
+        {
+            if (!task) return;
+            if (_mode.load() == Mode::INLINE)
+            {
+                task();
+                return;
+            }
+            _pending.fetch_add(1);
+            _queue.push(std::move(task));
+            wake();
+        }
+
+        void UIDispatcher::wake()
+        {
+            if (_wakePending.exchange(true)) return;
+            auto hook = std::atomic_load(&_wakeup);
+            if (hook) (*hook)();
+        }
+
+        size_t UIDispatcher::drain(size_t maxTasks)
+        {
+            //clear first, a post racing with the loop below schedules another drain
+            _wakePending.store(false);
+
+            size_t ran = 0;
+            Task task;
+            while (ran < maxTasks && _queue.pop(task))
+            {
+                _pending.fetch_sub(1);
+                task();
+                task.reset();
+                ran++;
+            }
+            if (ran == maxTasks && _pending.load() > 0)
+                wake();
+            return ran;
+        }
+    }
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "MpscQueue.h"
+
+// callables up to this size are stored inside the Task, larger ones go to BufferPool
+#define UI_TASK_INLINE_SIZE 48
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * Move-only type-erased `void()` callable.
+         * Small callables (a shared_ptr and a couple of pointers) live in the task itself,
+         * so posting a delegate callback costs no allocation beyond the queue node.
+         */
+        class Task
+        {
+        public:
+            Task() {}
+
+            template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+            Task(F &&fn)
+            {
+                typedef typename std::decay<F>::type Fn;
+                store<Fn>(std::forward<F>(fn), std::integral_constant<bool,
+                    sizeof(Fn) <= UI_TASK_INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t)
+                    && std::is_nothrow_move_constructible<Fn>::value>());
+            }
+
+            Task(Task &&other) noexcept { moveFrom(other); }
+
+            Task &operator=(Task &&other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    moveFrom(other);
+                }
+                return *this;
+            }
+
+            Task(const Task &) = delete;
+            Task &operator=(const Task &) = delete;
+
+            ~Task() { reset(); }
+
+            explicit operator bool() const { return _ops != nullptr; }
+            void operator()() { _ops->invoke(_storage); }
+
+            void reset()
+            {
+                if (!_ops) return;
+                _ops->destroy(_storage);
+                _ops = nullptr;
+            }
+
+        private:
+            struct Ops {
+                void(*invoke)(void *self);
+                void(*move)(void *dst, void *src);     //move-construct dst and destroy src
+                void(*destroy)(void *self);
+            };
+
+            template<typename Fn>
+            struct InlineOps {
+                static void invoke(void *self) { (*static_cast<Fn*>(self))(); }
+                static void move(void *dst, void *src)
+                {
+                    new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+                    static_cast<Fn*>(src)->~Fn();
+                }
+                static void destroy(void *self) { static_cast<Fn*>(self)->~Fn(); }
+                static const Ops ops;
+            };
+
+            template<typename Fn>
+            struct HeapOps {
+                static Fn *&target(void *self) { return *static_cast<Fn**>(self); }
+                static void invoke(void *self) { (*target(self))(); }
+                static void move(void *dst, void *src) { *static_cast<Fn**>(dst) = target(src); }
+                static void destroy(void *self)
+                {
+                    Fn *fn = target(self);
+                    fn->~Fn();
+                    BufferPool::release(fn);
+                }
+                static const Ops ops;
+            };
+
+            template<typename Fn, typename F>
+            void store(F &&fn, std::true_type)
+            {
+                new (_storage) Fn(std::forward<F>(fn));
+                _ops = &InlineOps<Fn>::ops;
+            }
+
+            template<typename Fn, typename F>
+            void store(F &&fn, std::false_type)
+            {
+                void *mem = BufferPool::getInstance().acquire(sizeof(Fn));
+                *reinterpret_cast<Fn**>(_storage) = new (mem) Fn(std::forward<F>(fn));
+                _ops = &HeapOps<Fn>::ops;
+            }
+
+            void moveFrom(Task &other)
+            {
+                _ops = other._ops;
+                if (_ops) _ops->move(_storage, other._storage);
+                other._ops = nullptr;
+            }
+
+            alignas(std::max_align_t) unsigned char _storage[UI_TASK_INLINE_SIZE];
+            const Ops *_ops = nullptr;
+        };
+
+        template<typename Fn>
+        const Task::Ops Task::InlineOps<Fn>::ops = { &Task::InlineOps<Fn>::invoke, &Task::InlineOps<Fn>::move, &Task::InlineOps<Fn>::destroy };
+
+        template<typename Fn>
+        const Task::Ops Task::HeapOps<Fn>::ops = { &Task::HeapOps<Fn>::invoke, &Task::HeapOps<Fn>::move, &Task::HeapOps<Fn>::destroy };
+
+        /**
+         * Hands delegate callbacks from the net thread to the application thread.
+         * QUEUED (default): post() never waits on the consumer (see MpscQueue), the application calls drain() from the one thread
+         * that owns its WebSocket objects, e.g. once per frame. A wakeup hook lets an engine schedule
+         * that drain itself instead of polling.
+         * INLINE: callbacks run on the net thread as soon as they are posted; the delegate must be
+         * thread-safe and quick, every connection waits for it.
+         */
+        class UIDispatcher
+        {
+        public:
+            enum class Mode {
+                INLINE,
+                QUEUED,
+            };
+
+            static UIDispatcher &getInstance();
+
+            void setMode(Mode mode) { _mode.store(mode); }
+            Mode getMode() const { return _mode.load(); }
+
+            // called on the posting thread when tasks arrive while no drain is pending, at most once
+            // until the next drain(). must not block, typically schedules drain() on the app thread.
+            void setWakeup(const std::function<void()> &wakeup);
+
+            // any thread
+            void post(Task &&task);
+
+            // application thread only. runs up to `maxTasks` queued tasks, returns how many ran.
+            // if tasks are left over, the wakeup hook fires again.
+            size_t drain(size_t maxTasks = SIZE_MAX);
+
+            // tasks posted but not yet run
+            size_t pending() const { return _pending.load(); }
+
+        private:
+            UIDispatcher() {}
+            UIDispatcher(const UIDispatcher &) = delete;
+
+            void wake();
+
+            MpscQueue<Task> _queue;
+            std::atomic<size_t> _pending{ 0 };
+            std::atomic<Mode> _mode{ Mode::QUEUED };
+            std::atomic<bool> _wakePending{ false };
+            std::shared_ptr<std::function<void()>> _wakeup;     //swapped with std::atomic_load/store
+        };
+    }
+}
@@ -0,0 +1,442 @@
+#include "Utf8Validator.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define UTF8_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define UTF8_TARGET(t)
+#else
+#define UTF8_TARGET(t) __attribute__((target(t)))
+#endif
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && (defined(__ARM_NEON) || defined(_MSC_VER))
+#define UTF8_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace cocos2d
+{
+    namespace network
+    {
+        namespace
+        {
+            /*
+             * The vector kernels follow Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+             * Three nibble lookups classify every byte pair, the result flags each kind of error with one bit:
+             */
+            const uint8_t TOO_SHORT = 1 << 0;      // 11______ 0_______ / 11______ 11______
+            const uint8_t TOO_LONG = 1 << 1;       // 0_______ 10______
+            const uint8_t OVERLONG_3 = 1 << 2;     // 11100000 100_____
+            const uint8_t TOO_LARGE = 1 << 3;      // 11110100 1001____ and above
+            const uint8_t SURROGATE = 1 << 4;      // 11101101 101_____
+            const uint8_t OVERLONG_2 = 1 << 5;     // 1100000_ 10______
+            const uint8_t TOO_LARGE_1000 = 1 << 6; // 11110101 1000____ and above
+            const uint8_t OVERLONG_4 = 1 << 6;     // 11110000 1000____
+            const uint8_t TWO_CONTS = 1 << 7;      // 10______ 10______
+            const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+            // indexed by the high nibble of the first byte of a pair
+            const uint8_t BYTE_1_HIGH[16] = {
+                TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+                TOO_SHORT | OVERLONG_2,
+                TOO_SHORT,
+                TOO_SHORT | OVERLONG_3 | SURROGATE,
+                TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+            };
+            // indexed by the low nibble of the first byte
+            const uint8_t BYTE_1_LOW[16] = {
+                CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+                CARRY | OVERLONG_2,
+                CARRY,
+                CARRY,
+                CARRY | TOO_LARGE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000
+            };
+            // indexed by the high nibble of the second byte
+            const uint8_t BYTE_2_HIGH[16] = {
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+            };
+            // a block ending in these bytes leaves a sequence open: >= 0xC0 last, >= 0xE0 second last, >= 0xF0 third last
+            const uint8_t INCOMPLETE_MAX_LAST3[3] = { 0xF0 - 1, 0xE0 - 1, 0xC0 - 1 };
+
+            bool validateScalar(const uint8_t *s, size_t len)
+            {
+                size_t i = 0;
+                while (i < len)
+                {
+                    if (i + 8 <= len)
+                    {
+                        uint64_t v;
+                        memcpy(&v, s + i, 8);
+                        if ((v & 0x8080808080808080ULL) == 0)
+                        {
+                            i += 8;
+                            continue;
+                        }
+                    }
+
+                    uint8_t c = s[i];
+                    if (c < 0x80)
+                    {
+                        i++;
+                        continue;
+                    }
+
+                    size_t n;
+                    uint8_t lo = 0x80, hi = 0xBF;
+                    if (c >= 0xC2 && c <= 0xDF) n = 1;
+                    else if (c == 0xE0) { n = 2; lo = 0xA0; }
+                    else if (c >= 0xE1 && c <= 0xEC) n = 2;
+                    else if (c == 0xED) { n = 2; hi = 0x9F; }
+                    else if (c >= 0xEE && c <= 0xEF) n = 2;
+                    else if (c == 0xF0) { n = 3; lo = 0x90; }
+                    else if (c >= 0xF1 && c <= 0xF3) n = 3;
+                    else if (c == 0xF4) { n = 3; hi = 0x8F; }
+                    else return false;
+
+                    if (len - i - 1 < n) return false;
+                    if (s[i + 1] < lo || s[i + 1] > hi) return false;
+                    for (size_t k = 2; k <= n; k++)
+                        if ((s[i + k] & 0xC0) != 0x80) return false;
+                    i += n + 1;
+                }
+                return true;
+            }
+
+#if defined(UTF8_X86)
+            UTF8_TARGET("ssse3")
+            inline __m128i sseCheckBlock(__m128i input, __m128i prev)
+            {
+                const __m128i lowNibble = _mm_set1_epi8(0x0F);
+                const __m128i t1h = _mm_loadu_si128((const __m128i*)BYTE_1_HIGH);
+                const __m128i t1l = _mm_loadu_si128((const __m128i*)BYTE_1_LOW);
+                const __m128i t2h = _mm_loadu_si128((const __m128i*)BYTE_2_HIGH);
+
+                __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+                __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+                __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+
+                __m128i b1h = _mm_shuffle_epi8(t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble));
+                __m128i b1l = _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, lowNibble));
+                __m128i b2h = _mm_shuffle_epi8(t2h, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble));
+                __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+                //third and fourth bytes of 3/4 byte sequences are the only legal TWO_CONTS
+                __m128i isThird = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+                __m128i isFourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+                __m128i must23 = _mm_and_si128(_mm_or_si128(isThird, isFourth), _mm_set1_epi8((char)0x80));
+                return _mm_xor_si128(must23, special);
+            }
+
+            UTF8_TARGET("ssse3")
+            bool validateSsse3(const uint8_t *s, size_t len)
+            {
+                const __m128i maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    (char)INCOMPLETE_MAX_LAST3[0], (char)INCOMPLETE_MAX_LAST3[1], (char)INCOMPLETE_MAX_LAST3[2]);
+                __m128i error = _mm_setzero_si128();
+                __m128i prev = _mm_setzero_si128();
+                __m128i prevIncomplete = _mm_setzero_si128();
+
+                size_t i = 0;
+                uint8_t tail[16];
+                while (i < len)
+                {
+                    __m128i input;
+                    if (i + 16 <= len)
+                    {
+                        input = _mm_loadu_si128((const __m128i*)(s + i));
+                    }
+                    else
+                    {
+                        memset(tail, 0, sizeof(tail));
+                        memcpy(tail, s + i, len - i);
+                        input = _mm_loadu_si128((const __m128i*)tail);
+                    }
+
+                    if (_mm_movemask_epi8(input) == 0)
+                    {
+                        error = _mm_or_si128(error, prevIncomplete);
+                    }
+                    else
+                    {
+                        error = _mm_or_si128(error, sseCheckBlock(input, prev));
+                        prevIncomplete = _mm_subs_epu8(input, maxValue);
+                    }
+                    prev = input;
+                    i += 16;
+                }
+                error = _mm_or_si128(error, prevIncomplete);
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+            }
+
+            UTF8_TARGET("avx2")
+            inline __m256i avxCheckBlock(__m256i input, __m256i prev)
+            {
+                const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+                const __m256i t1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BYTE_1_HIGH));
+                const __m256i t1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BYTE_1_LOW));
+                const __m256i t2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BYTE_2_HIGH));
+
+                //upper half of prev + lower half of input, so alignr can reach across the 128 bit lanes
+                __m256i carried = _mm256_permute2x128_si256(prev, input, 0x21);
+                __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+                __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+                __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+                __m256i b1h = _mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble));
+                __m256i b1l = _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, lowNibble));
+                __m256i b2h = _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble));
+                __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+                __m256i isThird = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+                __m256i isFourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+                __m256i must23 = _mm256_and_si256(_mm256_or_si256(isThird, isFourth), _mm256_set1_epi8((char)0x80));
+                return _mm256_xor_si256(must23, special);
+            }
+
+            UTF8_TARGET("avx2")
+            bool validateAvx2(const uint8_t *s, size_t len)
+            {
+                const __m256i maxValue = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    (char)INCOMPLETE_MAX_LAST3[0], (char)INCOMPLETE_MAX_LAST3[1], (char)INCOMPLETE_MAX_LAST3[2]);
+                __m256i error = _mm256_setzero_si256();
+                __m256i prev = _mm256_setzero_si256();
+                __m256i prevIncomplete = _mm256_setzero_si256();
+
+                size_t i = 0;
+                uint8_t tail[32];
+                while (i < len)
+                {
+                    __m256i input;
+                    if (i + 32 <= len)
+                    {
+                        input = _mm256_loadu_si256((const __m256i*)(s + i));
+                    }
+                    else
+                    {
+                        memset(tail, 0, sizeof(tail));
+                        memcpy(tail, s + i, len - i);
+                        input = _mm256_loadu_si256((const __m256i*)tail);
+                    }
+
+                    if (_mm256_movemask_epi8(input) == 0)
+                    {
+                        error = _mm256_or_si256(error, prevIncomplete);
+                    }
+                    else
+                    {
+                        error = _mm256_or_si256(error, avxCheckBlock(input, prev));
+                        prevIncomplete = _mm256_subs_epu8(input, maxValue);
+                    }
+                    prev = input;
+                    i += 32;
+                }
+                error = _mm256_or_si256(error, prevIncomplete);
+                return _mm256_testz_si256(error, error) != 0;
+            }
+
+            bool cpuHas(int level)
+            {
+                //level 1: ssse3, level 2: avx2
+#if defined(_MSC_VER)
+                int info[4];
+                __cpuid(info, 0);
+                int maxLeaf = info[0];
+                if (level == 1)
+                {
+                    __cpuid(info, 1);
+                    return (info[2] & (1 << 9)) != 0;
+                }
+                if (maxLeaf < 7) return false;
+                __cpuid(info, 1);
+                //avx2 also needs the OS to save ymm registers
+                bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+                if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+                __cpuidex(info, 7, 0);
+                return (info[1] & (1 << 5)) != 0;
+#else
+                __builtin_cpu_init();
+                return level == 1 ? __builtin_cpu_supports("ssse3") != 0 : __builtin_cpu_supports("avx2") != 0;
+#endif
+            }
+#endif
+
+#if defined(UTF8_NEON)
+            inline uint8x16_t neonCheckBlock(uint8x16_t input, uint8x16_t prev)
+            {
+                const uint8x16_t t1h = vld1q_u8(BYTE_1_HIGH);
+                const uint8x16_t t1l = vld1q_u8(BYTE_1_LOW);
+                const uint8x16_t t2h = vld1q_u8(BYTE_2_HIGH);
+                const uint8x16_t lowNibble = vdupq_n_u8(0x0F);
+
+                uint8x16_t prev1 = vextq_u8(prev, input, 15);
+                uint8x16_t prev2 = vextq_u8(prev, input, 14);
+                uint8x16_t prev3 = vextq_u8(prev, input, 13);
+
+                uint8x16_t b1h = vqtbl1q_u8(t1h, vshrq_n_u8(prev1, 4));
+                uint8x16_t b1l = vqtbl1q_u8(t1l, vandq_u8(prev1, lowNibble));
+                uint8x16_t b2h = vqtbl1q_u8(t2h, vshrq_n_u8(input, 4));
+                uint8x16_t special = vandq_u8(vandq_u8(b1h, b1l), b2h);
+
+                uint8x16_t isThird = vqsubq_u8(prev2, vdupq_n_u8(0xE0 - 0x80));
+                uint8x16_t isFourth = vqsubq_u8(prev3, vdupq_n_u8(0xF0 - 0x80));
+                uint8x16_t must23 = vandq_u8(vorrq_u8(isThird, isFourth), vdupq_n_u8(0x80));
+                return veorq_u8(must23, special);
+            }
+
+            bool validateNeon(const uint8_t *s, size_t len)
+            {
+                const uint8_t maxBytes[16] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+                    INCOMPLETE_MAX_LAST3[0], INCOMPLETE_MAX_LAST3[1], INCOMPLETE_MAX_LAST3[2] };
+                const uint8x16_t maxValue = vld1q_u8(maxBytes);
+                uint8x16_t error = vdupq_n_u8(0);
+                uint8x16_t prev = vdupq_n_u8(0);
+                uint8x16_t prevIncomplete = vdupq_n_u8(0);
+
+                size_t i = 0;
+                uint8_t tail[16];
+                while (i < len)
+                {
+                    uint8x16_t input;
+                    if (i + 16 <= len)
+                    {
+                        input = vld1q_u8(s + i);
+                    }
+                    else
+                    {
+                        memset(tail, 0, sizeof(tail));
+                        memcpy(tail, s + i, len - i);
+                        input = vld1q_u8(tail);
+                    }
+
+                    if (vmaxvq_u8(input) < 0x80)
+                    {
+                        error = vorrq_u8(error, prevIncomplete);
+                    }
+                    else
+                    {
+                        error = vorrq_u8(error, neonCheckBlock(input, prev));
+                        prevIncomplete = vqsubq_u8(input, maxValue);
+                    }
+                    prev = input;
+                    i += 16;
+                }
+                error = vorrq_u8(error, prevIncomplete);
+                return vmaxvq_u8(error) == 0;
+            }
+#endif
+
+            typedef bool(*ValidateFn)(const uint8_t *, size_t);
+
+            struct Kernel {
+                ValidateFn fn;
+                const char *name;
+            };
+
+            Kernel pickKernel()
+            {
+#if defined(UTF8_X86)
+                if (cpuHas(2)) return Kernel{ validateAvx2, "avx2" };
+                if (cpuHas(1)) return Kernel{ validateSsse3, "ssse3" };
+#elif defined(UTF8_NEON)
+                return Kernel{ validateNeon, "neon" };
+#endif
+                return Kernel{ validateScalar, "scalar" };
+            }
+
+            const Kernel &kernel()
+            {
+                static Kernel k = pickKernel();
+                return k;
+            }
+
+            //bytes a sequence starting with `c` spans, 0 for bytes that can't start one
+            size_t sequenceLength(uint8_t c)
+            {
+                if (c < 0x80) return 1;
+                if (c >= 0xC2 && c <= 0xDF) return 2;
+                if (c >= 0xE0 && c <= 0xEF) return 3;
+                if (c >= 0xF0 && c <= 0xF4) return 4;
+                return 0;
+            }
+        }
+
+        bool isValidUtf8(const uint8_t *data, size_t len)
+        {
+            if (len == 0) return true;
+            //short messages don't amortize a vector setup
+            if (len < 16) return validateScalar(data, len);
+            return kernel().fn(data, len);
+        }
+
+        const char *utf8ValidatorName()
+        {
+            return kernel().name;
+        }
+
+        bool Utf8Validator::update(const uint8_t *data, size_t len)
+        {
+            if (!_valid) return false;
+
+            size_t begin = 0;
+            if (_carryLen > 0)
+            {
+                //finish the sequence left open by the previous piece
+                size_t need = sequenceLength(_carry[0]) - _carryLen;
+                size_t take = std::min(need, len);
+                memcpy(_carry + _carryLen, data, take);
+                _carryLen += take;
+                begin = take;
+                if (take < need) return true;
+                _valid = validateScalar(_carry, _carryLen);
+                _carryLen = 0;
+                if (!_valid) return false;
+            }
+
+            //hold back a sequence cut off at the end of this piece
+            size_t end = len;
+            for (size_t k = 1; k <= 3 && k <= len - begin; k++)
+            {
+                uint8_t c = data[len - k];
+                if ((c & 0xC0) == 0x80) continue;
+                if (sequenceLength(c) > k) end = len - k;
+                break;
+            }
+
+            _valid = isValidUtf8(data + begin, end - begin);
+            if (_valid && end < len)
+            {
+                _carryLen = len - end;
+                memcpy(_carry, data + end, _carryLen);
+            }
+            return _valid;
+        }
+
+        bool Utf8Validator::finish()
+        {
+            bool ok = _valid && _carryLen == 0;
+            reset();
+            return ok;
+        }
+    }
+}
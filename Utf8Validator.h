@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * UTF-8 validation for text frames (RFC 3629: no overlongs, surrogates or code points above U+10FFFF).
+         * The kernel is picked once: AVX2 or SSSE3 by CPU detection on x86, NEON on arm64,
+         * a scalar loop with an ASCII fast path everywhere else.
+         */
+        bool isValidUtf8(const uint8_t *data, size_t len);
+
+        // name of the kernel isValidUtf8 runs on, for logs
+        const char *utf8ValidatorName();
+
+        /**
+         * Incremental validation of a message that arrives in pieces.
+         * Sequences split across pieces are carried over to the next update().
+         */
+        class Utf8Validator
+        {
+        public:
+            void reset() { _carryLen = 0; _valid = true; }
+            // false as soon as the bytes seen so far can't be valid UTF-8
+            bool update(const uint8_t *data, size_t len);
+            // true if everything was valid and no sequence is left unfinished
+            bool finish();
+
+        private:
+            uint8_t _carry[4];
+            size_t _carryLen = 0;
+            bool _valid = true;
+        };
+    }
+}
@@ -1,17 +1,25 @@
 #include "WebSocket.h"
 
 #include "WebSocketImpl.h"
+#include "BufferPool.h"
 
 #include <iostream>
 #include <vector>
 #include <string>
+#include <libwebsockets.h>
 
 namespace cocos2d
 {
     namespace network
     {
         WebSocket::WebSocket() { impl = std::make_shared<WebSocketImpl>(this); }
-        WebSocket::~WebSocket() { impl->sigClose(); impl.reset(); }
+        WebSocket::~WebSocket()
+        {
+            impl->sigClose();
+            //callbacks still queued in UIDispatcher must not reach this object
+            impl->_ws.store(nullptr);
+            impl.reset();
+        }
 
         bool WebSocket::init(const std::string &uri, WebSocketDelegate::Ptr delegate, const std::vector<std::string> &protocols, const std::string &caFile)
         {
@@ -20,11 +28,203 @@ namespace cocos2d
 
         void WebSocket::close() { impl->sigClose(); }
 
-        void WebSocket::closeAsync() { impl->sigCloseAsync(); }
+        std::shared_future<void> WebSocket::closeAsync() { return impl->sigCloseAsync(); }
+
+        bool WebSocket::closeAndWait(std::chrono::milliseconds timeout)
+        {
+            return impl->sigCloseAsync().wait_for(timeout) == std::future_status::ready;
+        }
+
+        WebSocket::SendResult WebSocket::send(const std::string &msg) { return impl->sigSend(msg.data(), msg.length(), false, SendOptions()); }
+
+        WebSocket::SendResult WebSocket::send(const char *data, size_t len) { return impl->sigSend(data, len, true, SendOptions()); }
+
+        WebSocket::SendResult WebSocket::send(const std::string &msg, const SendOptions &options) { return impl->sigSend(msg.data(), msg.length(), false, options); }
+
+        WebSocket::SendResult WebSocket::send(const char *data, size_t len, const SendOptions &options) { return impl->sigSend(data, len, true, options); }
+
+        WebSocket::SendResult WebSocket::send(SendBuffer &&buffer, bool isBinary, const SendOptions &options) { return impl->sigSend(std::move(buffer), isBinary, options); }
+
+        WebSocket::SendResult WebSocket::sendConflated(const std::string &key, const char *data, size_t len, bool isBinary)
+        {
+            SendOptions options;
+            options.conflationKey = key;
+            return impl->sigSend(data, len, isBinary, options);
+        }
+
+        WebSocket::SendResult WebSocket::sendConflated(const std::string &key, const std::string &msg)
+        {
+            return sendConflated(key, msg.data(), msg.length(), false);
+        }
+
+        WebSocket::SendResult WebSocket::sendStream(StreamSource source, bool isBinary, const SendOptions &options)
+        {
+            return impl->sigSendStream(std::move(source), isBinary, options);
+        }
+
+        void WebSocket::resumeStream() { impl->sigResumeStream(); }
+
+        WebSocket::SendResult WebSocket::sendBatch(const BatchEntry *entries, size_t count, Priority priority)
+        {
+            return impl->sigSendBatch(entries, count, priority);
+        }
+
+        WebSocket::SendResult WebSocket::sendBatch(const std::vector<BatchEntry> &entries, Priority priority)
+        {
+            return impl->sigSendBatch(entries.data(), entries.size(), priority);
+        }
+
+        size_t WebSocket::bufferedAmount() const { return impl->bufferedAmount(); }
+
+        void WebSocket::setBufferWatermarks(size_t high, size_t low) { impl->setBufferWatermarks(high, low); }
+
+        void WebSocket::setFragmentedReceive(bool enabled) { impl->setFragmentedReceive(enabled); }
+
+        void WebSocket::setReceiveFlowControl(size_t pauseAbove, size_t resumeBelow) { impl->setReceiveFlowControl(pauseAbove, resumeBelow); }
+
+        void WebSocket::setUtf8Validation(bool onReceive, bool onSend) { impl->setUtf8Validation(onReceive, onSend); }
+
+        void WebSocket::setBatchedReceive(bool enabled) { impl->setBatchedReceive(enabled); }
+
+        void WebSocket::setMaxMessageSize(size_t bytes) { impl->setMaxMessageSize(bytes); }
+
+        void WebSocket::setReceiveMemoryBudget(size_t bytes) { WebSocketImpl::_receiveMemoryBudget.store(bytes); }
+
+        size_t WebSocket::receiveMemoryInUse() { return WebSocketImpl::_receiveMemoryUsed.load(); }
+
+        size_t WebSocket::connectionCount() { return WebSocketImpl::_cachedSocketes.size(); }
+
+        void WebSocket::setNetThreadCount(size_t count) { WebSocketImpl::_netThreadCount.store(count > 0 ? count : 1); }
+
+        void WebSocket::setShardPolicy(ShardPolicy policy) { WebSocketImpl::_shardPolicy.store(policy); }
+
+        void WebSocket::setNetIdleLinger(std::chrono::milliseconds linger) { WebSocketImpl::_netIdleLinger.store(linger.count() > 0 ? linger.count() : 0); }
+
+        void WebSocket::prewarm() { WebSocketImpl::prewarm(); }
+
+
+        //////////////received data///////////////
+
+        void WebSocket::Data::retain() const
+        {
+            if (ext) NetRecvBlock::retain((NetRecvBlock*)ext);
+        }
+
+        void WebSocket::Data::release() const
+        {
+            if (ext) NetRecvBlock::release((NetRecvBlock*)ext);
+        }
+
+
+        WebSocket::Payload WebSocket::Data::detach() const
+        {
+            Payload payload;
+            payload._isBinary = isBinary;
+            if (ext && !isused)
+            {
+                //take over the dispatcher's reference
+                NetRecvBlock *block = (NetRecvBlock*)ext;
+                isused = 1;
+                payload._block = block;
+                payload._bytes = bytes;
+                payload._len = len;
+                return payload;
+            }
+
+            NetRecvBlock *block = NetRecvBlock::create(len);
+            if (len > 0)
+                block = NetRecvBlock::append(block, bytes, len);
+            payload._block = block;
+            payload._bytes = (char*)block->data();
+            payload._len = len;
+            return payload;
+        }
+
+        WebSocket::Payload::Payload(Payload &&o)
+            :_block(o._block), _bytes(o._bytes), _len(o._len), _isBinary(o._isBinary)
+        {
+            o._block = nullptr;
+            o._bytes = nullptr;
+            o._len = 0;
+        }
 
-        void WebSocket::send(const std::string &msg) { impl->sigSend(msg); }
+        WebSocket::Payload &WebSocket::Payload::operator=(Payload &&o)
+        {
+            if (this != &o)
+            {
+                release();
+                _block = o._block;
+                _bytes = o._bytes;
+                _len = o._len;
+                _isBinary = o._isBinary;
+                o._block = nullptr;
+                o._bytes = nullptr;
+                o._len = 0;
+            }
+            return *this;
+        }
 
-        void WebSocket::send(const char *data, size_t len) { impl->sigSend(data, len); }
+        void WebSocket::Payload::release()
+        {
+            if (_block)
+            {
+                NetRecvBlock::release((NetRecvBlock*)_block);
+                _block = nullptr;
+            }
+            _bytes = nullptr;
+            _len = 0;
+        }
+
+
+        //////////////send buffer///////////////
+
+        WebSocket::SendBuffer::SendBuffer(uint8_t *block, size_t len, Releaser release)
+            :_block(block), _size(len), _release(std::move(release))
+        {}
+
+        WebSocket::SendBuffer::SendBuffer(SendBuffer &&o)
+            :_block(o._block), _size(o._size), _release(std::move(o._release)), _pooled(o._pooled)
+        {
+            o._block = nullptr;
+            o._size = 0;
+        }
+
+        WebSocket::SendBuffer &WebSocket::SendBuffer::operator=(SendBuffer &&o)
+        {
+            if (this != &o)
+            {
+                reset();
+                _block = o._block;
+                _size = o._size;
+                _release = std::move(o._release);
+                _pooled = o._pooled;
+                o._block = nullptr;
+                o._size = 0;
+            }
+            return *this;
+        }
+
+        WebSocket::SendBuffer::~SendBuffer() { reset(); }
+
+        void WebSocket::SendBuffer::reset()
+        {
+            if (_block)
+            {
+                if (_release) _release(_block);
+                else if (_pooled) BufferPool::release(_block);
+                _block = nullptr;
+            }
+            _size = 0;
+        }
+
+        WebSocket::SendBuffer WebSocket::SendBuffer::allocate(size_t len)
+        {
+            SendBuffer buffer((uint8_t*)BufferPool::getInstance().acquire(len + headroom()), len, nullptr);
+            buffer._pooled = true;
+            return buffer;
+        }
+
+        size_t WebSocket::SendBuffer::headroom() { return LWS_PRE; }
 
 
         //////////////default delegate impl///////////////
@@ -49,5 +249,19 @@ namespace cocos2d
         {
            // std::cout << "Websocket " << "recieve data " << data.len << " bytes !" << std::endl;
         }
+
+        void WebSocketDelegate::onMessages(WebSocket &ws, const WebSocket::Data *messages, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+                onMesage(ws, messages[i]);
+        }
+
+        void WebSocketDelegate::onMessageFragment(WebSocket &ws, const WebSocket::Data &data, bool isFirst, bool isFinal)
+        {
+        }
+
+        void WebSocketDelegate::onDrain(WebSocket &ws)
+        {
+        }
     }
 }
@@ -3,6 +3,10 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <functional>
+#include <chrono>
+#include <future>
+#include <cstdint>
 
 namespace cocos2d
 {
@@ -10,17 +14,93 @@ namespace cocos2d
     {
         class WebSocketDelegate;
         class WebSocketImpl;
+        class NetDataPack;
         class WebSocket {
         public:
+            /**
+             * Outgoing message buffer whose memory is handed over to the net thread without copying.
+             * The payload must be preceded by headroom() spare bytes, which lws uses for the frame header.
+             */
+            class SendBuffer {
+            public:
+                typedef std::function<void(uint8_t *block)> Releaser;
+
+                SendBuffer() {}
+                // adopt caller-owned memory, `block` holds headroom() bytes followed by `len` bytes of payload.
+                // `release` is invoked with `block` on the net thread once the message is written or dropped;
+                // without one the block stays the caller's and is left untouched.
+                SendBuffer(uint8_t *block, size_t len, Releaser release);
+                SendBuffer(SendBuffer &&o);
+                SendBuffer &operator=(SendBuffer &&o);
+                SendBuffer(const SendBuffer &) = delete;
+                SendBuffer &operator=(const SendBuffer &) = delete;
+                ~SendBuffer();
+
+                // allocate a pooled buffer with room for `len` bytes of payload, fill it through data()
+                static SendBuffer allocate(size_t len);
+                static size_t headroom();
+
+                uint8_t *data() { return _block ? _block + headroom() : nullptr; }
+                size_t size() const { return _size; }
+                bool empty() const { return _block == nullptr; }
+            private:
+                void reset();
+
+                uint8_t *_block = nullptr;
+                size_t _size = 0;
+                Releaser _release;
+                bool _pooled = false;   //from allocate(), goes back to BufferPool
+
+                friend class NetDataPack;
+            };
+
+            struct Data;
+
+            /**
+             * Received message bytes owned by the application, obtained through Data::detach().
+             * The pooled buffer goes back to the pool on release() or destruction.
+             */
+            class Payload {
+            public:
+                Payload() {}
+                Payload(Payload &&o);
+                Payload &operator=(Payload &&o);
+                Payload(const Payload &) = delete;
+                Payload &operator=(const Payload &) = delete;
+                ~Payload() { release(); }
+
+                char *data() { return _bytes; }
+                const char *data() const { return _bytes; }
+                size_t size() const { return _len; }
+                bool isBinary() const { return _isBinary; }
+                bool empty() const { return _block == nullptr; }
+
+                void release();
+            private:
+                void *_block = nullptr;
+                char *_bytes = nullptr;
+                size_t _len = 0;
+                bool _isBinary = false;
+
+                friend struct Data;
+            };
+
             struct Data {
-                Data();
+                Data() {}
                 Data(char *bytes, size_t len, bool isBinary) :bytes(bytes), len(len), isBinary(isBinary)
                 {}
+                // bytes are recycled once onMesage returns, retain() keeps them until the matching release()
+                void retain() const;
+                void release() const;
+                // move the buffer out without copying, the dispatcher no longer recycles it when the callback returns.
+                // `bytes` stays readable while the Payload lives. copies if the Data isn't backed by a pooled block.
+                Payload detach() const;
+
                 char *bytes = nullptr;
                 size_t len = 0;
-                size_t isused = 0;
-                bool isBinary;
-                void *ext;
+                mutable size_t isused = 0;  //set once detached
+                bool isBinary = false;
+                mutable void *ext = nullptr;    //pooled receive block backing `bytes`
             };
 
             enum class State
@@ -31,6 +111,56 @@ namespace cocos2d
                 CLOSED
             };
 
+            enum class SendResult
+            {
+                OK,
+                WOULD_BLOCK,    //bufferedAmount() is above the high watermark, the message was not queued
+                INVALID_UTF8,   //text message rejected by outgoing UTF-8 validation
+            };
+
+            // send lanes, netOnWritable serves higher lanes first and switches only between messages
+            enum class Priority
+            {
+                HIGH,
+                NORMAL,
+                LOW,
+            };
+
+            struct SendCompletion {
+                enum class Status
+                {
+                    SENT,       //last frame handed to the socket
+                    REPLACED,   //superseded by a newer message with the same conflation key
+                    DROPPED,    //connection closed before the message was written
+                };
+                Status status;
+                size_t len;
+                std::chrono::steady_clock::time_point enqueuedAt;   //send() was called
+                std::chrono::steady_clock::time_point writtenAt;    //status was decided on the net thread
+            };
+            typedef std::function<void(const SendCompletion &)> SendCallback;
+
+            struct SendOptions {
+                SendOptions(Priority priority = Priority::NORMAL) :priority(priority) {}
+                Priority priority;
+                // non-empty: replaces a queued, not yet started message with the same key in place
+                std::string conflationKey;
+                // invoked once per message, dispatched like the delegate callbacks
+                SendCallback onComplete;
+            };
+
+            // fill at most `capacity` bytes into `buffer` and return the count, set `isFinal` with the last chunk.
+            // called on the net thread whenever the previous chunk is written; returning 0 without
+            // `isFinal` means no data yet, the source is left alone until WebSocket::resumeStream().
+            typedef std::function<size_t(char *buffer, size_t capacity, bool &isFinal)> StreamSource;
+
+            struct BatchEntry {
+                BatchEntry(const char *data, size_t len, bool isBinary) :data(data), len(len), isBinary(isBinary) {}
+                const char *data;
+                size_t len;
+                bool isBinary;
+            };
+
             enum class ErrorCode
             {
                 TIME_OUT,
@@ -44,10 +174,70 @@ namespace cocos2d
             virtual ~WebSocket();
 
             bool init(const std::string &uri, std::shared_ptr<WebSocketDelegate>  delegate, const std::vector<std::string> &protocols, const std::string &caFile);
+            // start the close handshake and return at once
             void close();
-            void closeAsync();
-            void send(const char *data, size_t len);
-            void send(const std::string &msg);
+            // start the close handshake, the future is ready once the connection is closed
+            std::shared_future<void> closeAsync();
+            // close and wait up to `timeout` for it to finish, false on timeout.
+            // must not run on the net thread, i.e. not from a delegate with UIDispatcher::Mode::INLINE
+            bool closeAndWait(std::chrono::milliseconds timeout);
+            SendResult send(const char *data, size_t len);
+            SendResult send(const std::string &msg);
+            SendResult send(const char *data, size_t len, const SendOptions &options);
+            SendResult send(const std::string &msg, const SendOptions &options);
+            // on WOULD_BLOCK the buffer is left untouched and can be sent again later
+            SendResult send(SendBuffer &&buffer, bool isBinary = true, const SendOptions &options = SendOptions());
+            // only the latest message per key matters, an older one still waiting in the queue is replaced
+            SendResult sendConflated(const std::string &key, const char *data, size_t len, bool isBinary = true);
+            SendResult sendConflated(const std::string &key, const std::string &msg);
+            // send one message of unknown length as continuation frames, pulled chunk by chunk from `source`
+            SendResult sendStream(StreamSource source, bool isBinary = true, const SendOptions &options = SendOptions());
+            // any thread, after a StreamSource that returned no data has more: poll it again
+            void resumeStream();
+            // copy `count` messages into one block and hand them to the net thread in a single command
+            SendResult sendBatch(const BatchEntry *entries, size_t count, Priority priority = Priority::NORMAL);
+            SendResult sendBatch(const std::vector<BatchEntry> &entries, Priority priority = Priority::NORMAL);
+
+            // payload bytes queued but not yet handed to the socket
+            size_t bufferedAmount() const;
+            // send() reports WOULD_BLOCK once bufferedAmount() reaches `high`,
+            // WebSocketDelegate::onDrain follows when it falls to `low` again. unlimited by default.
+            void setBufferWatermarks(size_t high, size_t low);
+            // deliver each received chunk through WebSocketDelegate::onMessageFragment instead of
+            // reassembling whole messages for onMesage, takes effect from the next message
+            void setFragmentedReceive(bool enabled);
+            // stop reading from the socket while more than `pauseAbove` received bytes wait for the delegate,
+            // resume once they drop to `resumeBelow`. disabled by default.
+            void setReceiveFlowControl(size_t pauseAbove, size_t resumeBelow);
+            // check text frames for valid UTF-8. invalid incoming text closes the connection with 1007,
+            // invalid outgoing text is refused with INVALID_UTF8. on for receive, off for send by default.
+            void setUtf8Validation(bool onReceive, bool onSend);
+            // hand all messages completed in one poll of the net thread to WebSocketDelegate::onMessages at once
+            void setBatchedReceive(bool enabled);
+            // close with 1009 once an incoming message grows past `bytes`. unlimited by default.
+            void setMaxMessageSize(size_t bytes);
+
+            // received payload bytes all connections may hold at once, counted from arrival until the
+            // delegate returns. a connection whose next chunk would exceed it is closed with 1009.
+            // unlimited by default.
+            static void setReceiveMemoryBudget(size_t bytes);
+            static size_t receiveMemoryInUse();
+            // connections initialised and not yet closed, across all net threads
+            static size_t connectionCount();
+
+            enum class ShardPolicy {
+                LEAST_LOADED,   //the net thread with the fewest open connections
+                HASH,           //fixed by connection id, spreads evenly without comparing loads
+            };
+            // connections are spread over `count` net threads, each with its own libuv loop and lws context.
+            // applies to connections created afterwards. 1 by default.
+            static void setNetThreadCount(size_t count);
+            static void setShardPolicy(ShardPolicy policy);
+            // keep an idle net thread, its loop and lws context around this long after its last connection
+            // closed, so a reconnect skips the cold start. 0 (default) stops it right away.
+            static void setNetIdleLinger(std::chrono::milliseconds linger);
+            // start the net threads now instead of on the first init(), e.g. during app startup
+            static void prewarm();
 
         private:
             std::shared_ptr<WebSocketImpl> impl;
@@ -61,6 +251,12 @@ namespace cocos2d
             virtual void onDisconnected(WebSocket &ws);
             virtual void onError(WebSocket &ws, int errCode);
             virtual void onMesage(WebSocket &ws, const WebSocket::Data &data);
+            // messages in arrival order, only with setBatchedReceive(true). calls onMesage for each by default
+            virtual void onMessages(WebSocket &ws, const WebSocket::Data *messages, size_t count);
+            // one received chunk of at most the lws rx buffer size, only with setFragmentedReceive(true)
+            virtual void onMessageFragment(WebSocket &ws, const WebSocket::Data &data, bool isFirst, bool isFinal);
+            // buffered data fell below the low watermark after a send() returned WOULD_BLOCK
+            virtual void onDrain(WebSocket &ws);
         };
 
     }
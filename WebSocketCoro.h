@@ -0,0 +1,300 @@
+#pragma once
+
+// C++20 coroutine front end for WebSocket, compiled only when the compiler supports coroutines
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "WebSocket.h"
+#include "UIDispatcher.h"
+
+namespace cocos2d
+{
+    namespace network
+    {
+        /**
+         * Fire-and-forget coroutine: starts running at once and frees its frame when it returns.
+         */
+        struct CoTask {
+            struct promise_type {
+                CoTask get_return_object() { return CoTask(); }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        // where a suspended coroutine continues once its operation completes
+        enum class CoExecutor {
+            INLINE,         //inside the delegate callback, i.e. wherever UIDispatcher runs it (net thread in INLINE mode)
+            DISPATCHER,     //always through UIDispatcher::post, on the thread that calls drain()
+        };
+
+        struct CoReceived {
+            WebSocket::Payload payload;
+            bool closed = false;    //the connection closed, payload is empty
+        };
+
+        struct CoSendResult {
+            WebSocket::SendResult result = WebSocket::SendResult::OK;
+            WebSocket::SendCompletion completion;   //valid when result is OK
+        };
+
+        /**
+         * WebSocket driven by co_await instead of a delegate:
+         *
+         *     if (!co_await ws.connect(uri)) co_return;
+         *     co_await ws.send("ping");
+         *     auto msg = co_await ws.receive();
+         *
+         * Awaiters live in the coroutine frame, received messages are detached (no copy) and
+         * send completion rides on SendOptions::onComplete, so a steady-state await allocates nothing
+         * besides what the callback path already does. At most one receive() may be pending at a time.
+         */
+        class CoWebSocket
+        {
+            class State;
+        public:
+            class ConnectAwaiter
+            {
+            public:
+                ConnectAwaiter(CoWebSocket &owner, const std::string &uri, const std::vector<std::string> &protocols, const std::string &caFile)
+                    :_owner(owner), _uri(uri), _protocols(protocols), _caFile(caFile) {}
+
+                bool await_ready() const noexcept { return false; }
+                bool await_suspend(std::coroutine_handle<> handle)
+                {
+                    State &state = *_owner._state;
+                    {
+                        std::lock_guard<std::mutex> guard(state.mtx);
+                        state.connectWaiter = handle;
+                        state.connectResult = &_connected;
+                    }
+                    if (_owner._ws->init(_uri, _owner._state, _protocols, _caFile))
+                        return true;
+                    //nothing was started, no callback will come
+                    std::lock_guard<std::mutex> guard(state.mtx);
+                    state.connectWaiter = nullptr;
+                    state.connectResult = nullptr;
+                    return false;
+                }
+                bool await_resume() const noexcept { return _connected; }
+
+            private:
+                CoWebSocket &_owner;
+                std::string _uri;
+                std::vector<std::string> _protocols;
+                std::string _caFile;
+                bool _connected = false;
+            };
+
+            class ReceiveAwaiter
+            {
+            public:
+                explicit ReceiveAwaiter(CoWebSocket &owner) :_owner(owner) {}
+
+                bool await_ready() const noexcept { return false; }
+                bool await_suspend(std::coroutine_handle<> handle)
+                {
+                    State &state = *_owner._state;
+                    std::lock_guard<std::mutex> guard(state.mtx);
+                    if (state.inboxHead < state.inbox.size())
+                    {
+                        _received.payload = std::move(state.inbox[state.inboxHead++]);
+                        if (state.inboxHead == state.inbox.size())
+                        {
+                            //keep the capacity, the next burst reuses it
+                            state.inbox.clear();
+                            state.inboxHead = 0;
+                        }
+                        return false;
+                    }
+                    if (state.closed)
+                    {
+                        _received.closed = true;
+                        return false;
+                    }
+                    state.receiveWaiter = handle;
+                    state.receiveSlot = &_received;
+                    return true;
+                }
+                CoReceived await_resume() noexcept { return std::move(_received); }
+
+            private:
+                CoWebSocket &_owner;
+                CoReceived _received;
+            };
+
+            class SendAwaiter
+            {
+            public:
+                SendAwaiter(CoWebSocket &owner, const std::string *text) :_owner(owner), _text(text) {}
+                SendAwaiter(CoWebSocket &owner, const char *data, size_t len) :_owner(owner), _data(data), _len(len) {}
+                SendAwaiter(CoWebSocket &owner, WebSocket::SendBuffer &&buffer, bool isBinary)
+                    :_owner(owner), _buffer(std::move(buffer)), _useBuffer(true), _isBinary(isBinary) {}
+
+                bool await_ready() const noexcept { return false; }
+                bool await_suspend(std::coroutine_handle<> handle)
+                {
+                    _handle = handle;
+                    if (_useBuffer && _buffer.empty())
+                    {
+                        //nothing to write, WebSocket::send reports OK without a completion
+                        _sent.completion.status = WebSocket::SendCompletion::Status::SENT;
+                        return false;
+                    }
+
+                    WebSocket::SendOptions options;
+                    //captures one pointer, fits std::function's inline storage
+                    options.onComplete = [this](const WebSocket::SendCompletion &completion) {
+                        _sent.completion = completion;
+                        if (_done.exchange(true))
+                            _owner._state->resume(_handle);
+                    };
+
+                    WebSocket &ws = *_owner._ws;
+                    if (_useBuffer)
+                        _sent.result = ws.send(std::move(_buffer), _isBinary, options);
+                    else if (_text)
+                        _sent.result = ws.send(*_text, options);
+                    else
+                        _sent.result = ws.send(_data, _len, options);
+
+                    if (_sent.result != WebSocket::SendResult::OK)
+                        return false;
+                    //the completion may already have run on another thread
+                    return !_done.exchange(true);
+                }
+                CoSendResult await_resume() const noexcept { return _sent; }
+
+            private:
+                CoWebSocket &_owner;
+                const std::string *_text = nullptr;
+                const char *_data = nullptr;
+                size_t _len = 0;
+                WebSocket::SendBuffer _buffer;
+                bool _useBuffer = false;
+                bool _isBinary = true;
+                std::coroutine_handle<> _handle;
+                std::atomic<bool> _done{ false };
+                CoSendResult _sent;
+            };
+
+            explicit CoWebSocket(CoExecutor executor = CoExecutor::INLINE)
+                :_state(std::make_shared<State>(executor)), _ws(new WebSocket()) {}
+
+            CoWebSocket(const CoWebSocket &) = delete;
+            CoWebSocket &operator=(const CoWebSocket &) = delete;
+
+            // the underlying socket, for settings and close()
+            WebSocket &socket() { return *_ws; }
+
+            // true once connected, false on error or if the connection closed first
+            ConnectAwaiter connect(const std::string &uri, const std::vector<std::string> &protocols = std::vector<std::string>(), const std::string &caFile = "")
+            {
+                return ConnectAwaiter(*this, uri, protocols, caFile);
+            }
+
+            // next whole message, queued messages are returned without suspending
+            ReceiveAwaiter receive() { return ReceiveAwaiter(*this); }
+
+            // resumes once the message is on the wire or dropped. `msg`/`data` must stay valid until
+            // the send is issued, which happens before the first suspension.
+            SendAwaiter send(const std::string &msg) { return SendAwaiter(*this, &msg); }
+            SendAwaiter send(const char *data, size_t len) { return SendAwaiter(*this, data, len); }
+            SendAwaiter send(WebSocket::SendBuffer &&buffer, bool isBinary = true) { return SendAwaiter(*this, std::move(buffer), isBinary); }
+
+        private:
+            class State : public WebSocketDelegate
+            {
+            public:
+                explicit State(CoExecutor executor) :executor(executor) {}
+
+                void resume(std::coroutine_handle<> handle)
+                {
+                    if (executor == CoExecutor::DISPATCHER)
+                        UIDispatcher::getInstance().post([handle]() { handle.resume(); });
+                    else
+                        handle.resume();
+                }
+
+                void onConnected(WebSocket &) override { finishConnect(true); }
+                void onError(WebSocket &, int) override { finishConnect(false); }
+
+                void onDisconnected(WebSocket &) override
+                {
+                    finishConnect(false);
+                    std::coroutine_handle<> waiter;
+                    {
+                        std::lock_guard<std::mutex> guard(mtx);
+                        closed = true;
+                        if (receiveWaiter)
+                        {
+                            receiveSlot->closed = true;
+                            waiter = receiveWaiter;
+                            receiveWaiter = nullptr;
+                        }
+                    }
+                    if (waiter) resume(waiter);
+                }
+
+                void onMesage(WebSocket &, const WebSocket::Data &data) override
+                {
+                    WebSocket::Payload payload = data.detach();
+                    std::coroutine_handle<> waiter;
+                    {
+                        std::lock_guard<std::mutex> guard(mtx);
+                        if (receiveWaiter)
+                        {
+                            receiveSlot->payload = std::move(payload);
+                            waiter = receiveWaiter;
+                            receiveWaiter = nullptr;
+                        }
+                        else
+                        {
+                            inbox.push_back(std::move(payload));
+                        }
+                    }
+                    if (waiter) resume(waiter);
+                }
+
+                void finishConnect(bool connected)
+                {
+                    std::coroutine_handle<> waiter;
+                    {
+                        std::lock_guard<std::mutex> guard(mtx);
+                        if (!connectWaiter) return;
+                        *connectResult = connected;
+                        waiter = connectWaiter;
+                        connectWaiter = nullptr;
+                        connectResult = nullptr;
+                    }
+                    resume(waiter);
+                }
+
+                const CoExecutor executor;
+                std::mutex mtx;     //uncontended unless the delegate runs on the net thread
+                bool closed = false;
+                std::coroutine_handle<> connectWaiter;
+                bool *connectResult = nullptr;
+                std::coroutine_handle<> receiveWaiter;
+                CoReceived *receiveSlot = nullptr;
+                //messages nobody awaited yet, consumed from inboxHead
+                std::vector<WebSocket::Payload> inbox;
+                size_t inboxHead = 0;
+            };
+
+            std::shared_ptr<State> _state;
+            std::unique_ptr<WebSocket> _ws;
+        };
+    }
+}
+
+#endif
@@ -1,17 +1,34 @@
 #include "WebSocketImpl.h"
 
 #include "Looper.h"
+#include "BufferPool.h"
+#include "MpscQueue.h"
+#include "UIDispatcher.h"
 
 #include <iostream>
 #include <memory>
 #include <cassert>
+#include <cstring>
+#include <climits>
 #include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <libwebsockets.h>
 
 using namespace cocos2d::loop;
 
 #define WS_RX_BUFFER_SIZE ((1 << 16) - 1)
 #define WS_REVERSED_RECEIVE_BUFFER_SIZE  (1 << 12)
+//bounds of the adaptive initial receive block including its header, frames lws already knows the size of may still go above
+#define WS_RECEIVE_RESERVE_MIN  (1 << 8)
+#define WS_RECEIVE_RESERVE_MAX  (1 << BUFFER_POOL_MAX_SHIFT)
+
+//bytes written in one LWS_CALLBACK_CLIENT_WRITEABLE before yielding to other connections
+#ifndef WS_WRITE_BUDGET_PER_CALLBACK
+#define WS_WRITE_BUDGET_PER_CALLBACK  (1 << 18)
+#endif
 
 #define CHECK_INVOKE_FLAG(flg)  do { \
     if(_callbackInvokeFlags & flg)  return 0; \
@@ -35,23 +52,112 @@ namespace cocos2d
         //////////////basic data type - begin /////////////
         enum class NetCmdType
         {
-            OPEN, CLOSE, WRITE, RECIEVE
+            OPEN, CLOSE, WRITE, RECIEVE, RESUME_RECEIVE, RESUME_SEND,
+            IDLE    //no connection left on this Helper, start the linger timer
+        };
+
+        /**
+         * Messages of one sendBatch() call, copied into a single pooled block:
+         * [Entry table][LWS_PRE][payload 0][LWS_PRE][payload 1]...
+         * each payload keeps its own headroom so lws can prepend the frame header in place.
+         */
+        class NetBatch {
+        public:
+            struct Entry {
+                size_t offset;
+                size_t len;
+                bool isBinary;
+            };
+
+            NetBatch(const WebSocket::BatchEntry *entries, size_t count, WebSocket::Priority priority) {
+                size_t tableSize = (count * sizeof(Entry) + 15) & ~(size_t)15;
+                size_t total = tableSize;
+                for (size_t i = 0; i < count; i++)
+                    total += LWS_PRE + entries[i].len;
+
+                _arena = (uint8_t*)BufferPool::getInstance().acquire(total);
+                _entries = (Entry*)_arena;
+                _count = count;
+                _priority = priority;
+
+                size_t offset = tableSize;
+                for (size_t i = 0; i < count; i++)
+                {
+                    offset += LWS_PRE;
+                    _entries[i].offset = offset;
+                    _entries[i].len = entries[i].len;
+                    _entries[i].isBinary = entries[i].isBinary;
+                    if (entries[i].len > 0)
+                        memcpy(_arena + offset, entries[i].data, entries[i].len);
+                    offset += entries[i].len;
+                }
+            }
+            ~NetBatch() {
+                BufferPool::release(_arena);
+                _arena = nullptr;
+            }
+
+            NetBatch(const NetBatch &) = delete;
+
+            size_t count() { return _count; }
+            Entry &entry(size_t i) { return _entries[i]; }
+            uint8_t *payload(size_t i) { return _arena + _entries[i].offset; }
+            WebSocket::Priority priority() { return _priority; }
+        private:
+            uint8_t *_arena = nullptr;
+            Entry *_entries = nullptr;
+            size_t _count = 0;
+            WebSocket::Priority _priority;
         };
 
         class NetDataPack {
         public:
             NetDataPack() {}
-            NetDataPack(const char *f, size_t l, bool isBinary) {
-                _data = (uint8_t*)calloc(1, l + LWS_PRE);
+            NetDataPack(const char *f, size_t l, bool isBinary, const WebSocket::SendOptions &options) {
+                _data = (uint8_t*)BufferPool::getInstance().acquire(l + LWS_PRE);
+                _pooled = true;
                 memcpy(_data + LWS_PRE, f, l);
                 _size = l;
                 _remain = l;
                 _payload = _data + LWS_PRE;
                 _isBinary = isBinary;
+                setOptions(options);
+            }
+            // take over the caller's block, the payload already sits behind LWS_PRE bytes of headroom
+            NetDataPack(WebSocket::SendBuffer &&buf, bool isBinary, const WebSocket::SendOptions &options) {
+                _data = buf._block;
+                _release = std::move(buf._release);
+                _pooled = buf._pooled;
+                _size = buf._size;
+                _remain = buf._size;
+                _payload = _data + LWS_PRE;
+                _isBinary = isBinary;
+                setOptions(options);
+                buf._block = nullptr;
+                buf._size = 0;
+            }
+            // streamed message, chunks of up to WS_RX_BUFFER_SIZE are pulled from `source` on the net thread
+            NetDataPack(WebSocket::StreamSource &&source, bool isBinary, const WebSocket::SendOptions &options) {
+                _source = std::move(source);
+                _lastChunk = false;
+                _isBinary = isBinary;
+                setOptions(options);
+                _key.clear();
+            }
+            // view into a batch block, which stays alive as long as any of its packs
+            NetDataPack(const std::shared_ptr<NetBatch> &batch, size_t index) {
+                auto &e = batch->entry(index);
+                _batch = batch;
+                _size = e.len;
+                _remain = e.len;
+                _payload = batch->payload(index);
+                _isBinary = e.isBinary;
+                _priority = static_cast<int>(batch->priority());
             }
             ~NetDataPack() {
                 if (_data) {
-                    free(_data);
+                    if (_release) _release(_data);
+                    else if (_pooled) BufferPool::release(_data);
                     _data = nullptr;
                 }
                 _size = 0;
@@ -72,7 +178,36 @@ namespace cocos2d
             }
 
             size_t consumed() { return _consumed; }
+            bool lastChunk() { return _lastChunk; }
+            //the frame carrying FIN has been written
+            bool finished() { return _finished; }
+            void finish() { _finished = true; }
+
+            // refill the chunk buffer of a streamed pack, returns the new payload size
+            size_t pull()
+            {
+                if (!_source) return 0;
+                if (!_data) _data = (uint8_t*)BufferPool::getInstance().acquire(LWS_PRE + WS_RX_BUFFER_SIZE);
+                bool isFinal = false;
+                size_t n = _source((char*)_data + LWS_PRE, WS_RX_BUFFER_SIZE, isFinal);
+                if (n > WS_RX_BUFFER_SIZE) n = WS_RX_BUFFER_SIZE;
+                _payload = _data + LWS_PRE;
+                _remain = n;
+                _size += n;
+                if (isFinal)
+                {
+                    _lastChunk = true;
+                    _source = nullptr;
+                }
+                return n;
+            }
             bool isBinary() { return _isBinary; }
+            int priority() { return _priority; }
+            const std::string &key() { return _key; }
+            size_t size() { return _size; }
+
+            WebSocket::SendCallback &callback() { return _onComplete; }
+            std::chrono::steady_clock::time_point enqueuedAt() { return _enqueuedAt; }
         private:
             uint8_t * _data = nullptr;
             uint8_t *_payload = nullptr;
@@ -80,29 +215,206 @@ namespace cocos2d
             size_t _remain = 0;
             bool _isBinary = true;
             size_t _consumed = 0;
+            bool _lastChunk = true;
+            bool _finished = false;
+            WebSocket::StreamSource _source;
+            int _priority = static_cast<int>(WebSocket::Priority::NORMAL);
+            std::string _key;
+            WebSocket::SendCallback _onComplete;
+            std::chrono::steady_clock::time_point _enqueuedAt;
+            WebSocket::SendBuffer::Releaser _release;
+            bool _pooled = false;   //_data came from BufferPool, otherwise only _release may free it
+            std::shared_ptr<NetBatch> _batch;
+
+            void setOptions(const WebSocket::SendOptions &options)
+            {
+                _priority = static_cast<int>(options.priority);
+                _key = options.conflationKey;
+                if (options.onComplete)
+                {
+                    _onComplete = options.onComplete;
+                    _enqueuedAt = std::chrono::steady_clock::now();
+                }
+            }
         };
 
         class NetCmd {
         public:
             NetCmd() {}
-            NetCmd(WebSocketImpl *ws, NetCmdType cmd, std::shared_ptr<NetDataPack> data) :ws(ws), cmd(cmd), data(data) {}
-            NetCmd(const NetCmd &o) :ws(o.ws), cmd(o.cmd), data(o.data) {}
+            //a queued command keeps its connection alive, the WebSocket may be deleted before the net thread gets to it
+            NetCmd(WebSocketImpl *ws, NetCmdType cmd, std::shared_ptr<NetDataPack> data) :ws(owner(ws)), cmd(cmd), data(data) {}
+            NetCmd(WebSocketImpl *ws, std::shared_ptr<NetBatch> batch) :ws(owner(ws)), cmd(NetCmdType::WRITE), batch(batch) {}
+            NetCmd(const NetCmd &o) = default;
+            NetCmd(NetCmd &&o) = default;
+            NetCmd &operator=(const NetCmd &o) = default;
+            NetCmd &operator=(NetCmd &&o) = default;
             static NetCmd Open(WebSocketImpl *ws);
             static NetCmd Close(WebSocketImpl *ws);
-            static NetCmd Write(WebSocketImpl *ws, const char *data, size_t len, bool isBinary);
+            static NetCmd Write(WebSocketImpl *ws, const char *data, size_t len, bool isBinary, const WebSocket::SendOptions &options);
+            static NetCmd Write(WebSocketImpl *ws, WebSocket::SendBuffer &&buffer, bool isBinary, const WebSocket::SendOptions &options);
+            static NetCmd WriteBatch(WebSocketImpl *ws, const WebSocket::BatchEntry *entries, size_t count, WebSocket::Priority priority);
         public:
-            WebSocketImpl * ws{ nullptr };
-            NetCmdType cmd;
+            WebSocketImpl::Ptr ws;
+            NetCmdType cmd{ NetCmdType::OPEN };
             std::shared_ptr<NetDataPack> data;
+            std::shared_ptr<NetBatch> batch;
+        private:
+            static WebSocketImpl::Ptr owner(WebSocketImpl *ws) { return ws ? ws->shared_from_this() : nullptr; }
         };
 
         NetCmd NetCmd::Open(WebSocketImpl *ws) { return NetCmd(ws, NetCmdType::OPEN, nullptr); }
         NetCmd NetCmd::Close(WebSocketImpl *ws) { return NetCmd(ws, NetCmdType::CLOSE, nullptr); }
-        NetCmd NetCmd::Write(WebSocketImpl *ws, const char *data, size_t len, bool isBinary)
+        NetCmd NetCmd::Write(WebSocketImpl *ws, const char *data, size_t len, bool isBinary, const WebSocket::SendOptions &options)
         {
-            auto pack = std::make_shared<NetDataPack>(data, len, isBinary);
+            auto pack = std::allocate_shared<NetDataPack>(PoolAllocator<NetDataPack>(), data, len, isBinary, options);
             return NetCmd(ws, NetCmdType::WRITE, pack);
         }
+        NetCmd NetCmd::Write(WebSocketImpl *ws, WebSocket::SendBuffer &&buffer, bool isBinary, const WebSocket::SendOptions &options)
+        {
+            auto pack = std::allocate_shared<NetDataPack>(PoolAllocator<NetDataPack>(), std::move(buffer), isBinary, options);
+            return NetCmd(ws, NetCmdType::WRITE, pack);
+        }
+        NetCmd NetCmd::WriteBatch(WebSocketImpl *ws, const WebSocket::BatchEntry *entries, size_t count, WebSocket::Priority priority)
+        {
+            auto batch = std::allocate_shared<NetBatch>(PoolAllocator<NetBatch>(), entries, count, priority);
+            return NetCmd(ws, batch);
+        }
+
+        NetRecvBlock *NetRecvBlock::create(size_t capacity)
+        {
+            static_assert(sizeof(NetRecvBlock) <= NetRecvBlock::HEADER_SIZE, "receive block header too large");
+            size_t blockSize = BufferPool::blockSize(HEADER_SIZE + capacity);
+            void *mem = BufferPool::getInstance().acquire(blockSize);
+            NetRecvBlock *block = new (mem) NetRecvBlock();
+            block->refs.store(1);
+            block->capacity = blockSize - HEADER_SIZE;
+            block->size = 0;
+            block->isBinary = false;
+            block->isFirst = false;
+            block->isFinal = false;
+            return block;
+        }
+
+        void NetRecvBlock::retain(NetRecvBlock *block)
+        {
+            block->refs.fetch_add(1);
+        }
+
+        void NetRecvBlock::release(NetRecvBlock *block)
+        {
+            if (block->refs.fetch_sub(1) == 1)
+            {
+                block->~NetRecvBlock();
+                BufferPool::release(block);
+            }
+        }
+
+        NetRecvBlock *NetRecvBlock::append(NetRecvBlock *block, const void *p, size_t len)
+        {
+            if (block->size + len > block->capacity)
+            {
+                NetRecvBlock *bigger = create(std::max(block->capacity * 2, block->size + len));
+                memcpy(bigger->data(), block->data(), block->size);
+                bigger->size = block->size;
+                release(block);
+                block = bigger;
+            }
+            memcpy(block->data() + block->size, p, len);
+            block->size += len;
+            return block;
+        }
+
+        /**
+         * Messages delivered together through onMessages, the Data array lives in one pooled block
+         * and every Data holds the reference of its NetRecvBlock.
+         */
+        class NetRecvBatch
+        {
+        public:
+            static NetRecvBatch *create(const std::vector<NetRecvBlock*> &blocks)
+            {
+                void *mem = BufferPool::getInstance().acquire(HEADER_SIZE + blocks.size() * sizeof(WebSocket::Data));
+                NetRecvBatch *batch = new (mem) NetRecvBatch();
+                batch->count = blocks.size();
+                batch->bytes = 0;
+                for (size_t i = 0; i < blocks.size(); i++)
+                {
+                    NetRecvBlock *block = blocks[i];
+                    WebSocket::Data *data = new (&batch->messages()[i]) WebSocket::Data((char*)block->data(), block->size, block->isBinary);
+                    data->ext = block;
+                    batch->bytes += block->size;
+                }
+                return batch;
+            }
+
+            static void destroy(NetRecvBatch *batch)
+            {
+                for (size_t i = 0; i < batch->count; i++)
+                {
+                    WebSocket::Data &data = batch->messages()[i];
+                    if (!data.isused)
+                        NetRecvBlock::release((NetRecvBlock*)data.ext);
+                    data.~Data();
+                }
+                batch->~NetRecvBatch();
+                BufferPool::release(batch);
+            }
+
+            WebSocket::Data *messages() { return reinterpret_cast<WebSocket::Data*>(reinterpret_cast<uint8_t*>(this) + HEADER_SIZE); }
+
+            size_t count;
+            size_t bytes;
+
+            static const size_t HEADER_SIZE = 16;
+        };
+
+        MessageSizeStats::MessageSizeStats()
+        {
+            memset(_buckets, 0, sizeof(_buckets));
+        }
+
+        void MessageSizeStats::add(size_t size)
+        {
+            if (_total == 0)
+                _ewma = (uint64_t)size << EWMA_SHIFT;
+            else
+                _ewma = _ewma - (_ewma >> EWMA_SHIFT) + size;
+
+            int bucket = 0;
+            while (bucket < BUCKETS - 1 && ((size_t)1 << bucket) < size) bucket++;
+            _buckets[bucket]++;
+            _total++;
+
+            if (++_sinceDecay >= DECAY_PERIOD)
+            {
+                _sinceDecay = 0;
+                _total = 0;
+                for (auto &b : _buckets)
+                {
+                    b >>= 1;
+                    _total += b;
+                }
+            }
+        }
+
+        size_t MessageSizeStats::percentile(int pct) const
+        {
+            if (_total == 0) return 0;
+            uint64_t rank = ((uint64_t)_total * pct + 99) / 100;
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; i++)
+            {
+                seen += _buckets[i];
+                if (seen >= rank) return (size_t)1 << i;
+            }
+            return (size_t)1 << (BUCKETS - 1);
+        }
+
+        size_t MessageSizeStats::suggest(size_t minSize, size_t maxSize) const
+        {
+            size_t s = std::max(percentile(95), ewma());
+            return std::min(std::max(s, minSize), maxSize);
+        }
 
         //////////////basic data type - end /////////////
 
@@ -112,7 +424,7 @@ namespace cocos2d
             int ret = 0;
             WebSocketImpl *ws = (WebSocketImpl*)lws_wsi_user(wsi);
             if (ws) {
-                ws->lwsCallback(wsi, reason, user, in, len);
+                ret = ws->lwsCallback(wsi, reason, user, in, len);
             }
             return ret;
         }
@@ -128,35 +440,75 @@ namespace cocos2d
             Helper();
             virtual ~Helper();
 
-            static std::shared_ptr<Helper> fetch();
-            static void drop();
+            // net thread serving a new connection, started on first use
+            static std::shared_ptr<Helper> fetch(int64_t wsId);
+            // the connection is gone, the thread quits once it has served none for the idle linger time
+            static void drop(const std::shared_ptr<Helper> &helper);
+            // start every net thread ahead of the first connection
+            static void prewarm();
 
             void init();
             void clear();
 
-            void send(const std::string &event, const NetCmd &cmd);
+            void send(NetCmd &&cmd);
+            bool isLoopThread() const { return _loopThread.load() == std::this_thread::get_id(); }
 
-            void runInUI(const std::function<void()> &fn);
+            // hand a delegate callback to the application thread, see UIDispatcher
+            void runInUI(Task &&task);
 
             void handleCmdConnect(NetCmd &cmd);
             void handleCmdDisconnect(NetCmd &cmd);
             void handleCmdWrite(NetCmd &cmd);
+            void dispatchCmds();
+            void startIdleTimer();
+
+            // flush the connection's receive batch once the current poll iteration is done
+            void queueReceiveBatch(WebSocketImpl *ws);
+            void removeReceiveBatch(WebSocketImpl *ws);
+            void flushReceiveBatches();
 
             uv_loop_t * getUVLoop() { return _looper->getUVLoop(); }
             void updateLibUV();
 
         private:
+            static std::shared_ptr<Helper> &slotAt(size_t shard);   //requires __sCacheHelperMutex
+            static void retire(const std::shared_ptr<Helper> &helper);  //requires __sCacheHelperMutex
+            static void onHandleClosed(uv_handle_t *handle);
+            // leave the pool and drop the self reference, may destroy this Helper
+            void release();
+
             //libwebsocket helper
             void initProtocols();
             lws_context_creation_info initCtxCreateInfo(const struct lws_protocols *protocols, bool useSSL);
 
         private:
-            static std::shared_ptr<Helper> __sCacheHelper;
+            //one Helper per net thread, a slot is empty until a connection lands on it
+            static std::vector<std::shared_ptr<Helper>> __sCacheHelpers;
             static std::mutex __sCacheHelperMutex;
 
+            size_t _shard = 0;
+            int _connections = 0;       //guarded by __sCacheHelperMutex
+            std::shared_ptr<Helper> _self;  //keeps a retired Helper alive until its thread has quit
+
             std::shared_ptr<Looper<NetCmd> > _looper = nullptr;
             HelperLoop *_loop = nullptr;
 
+            //commands from app threads, drained once per wakeup of _cmdAsync
+            MpscQueue<NetCmd> _cmdQueue;
+            uv_async_t _cmdAsync;
+            std::atomic<bool> _cmdAsyncReady{ false };
+            std::atomic<int> _cmdSenders{ 0 };
+            //set while the loop runs, lets calls made on it skip the command queue
+            std::atomic<std::thread::id> _loopThread;
+
+            //runs after each poll phase to hand over batched messages
+            uv_check_t _batchCheck;
+            //fires when no connection arrived within the idle linger time
+            uv_timer_t _idleTimer;
+            //handles closed in clear() whose callback hasn't run, the Helper must outlive them
+            int _pendingCloses = 0;
+            std::vector<WebSocketImpl*> _pendingReceiveBatches;
+
         public:
             //libwebsocket fields
             lws_protocols * _lwsDefaultProtocols = nullptr;
@@ -176,8 +528,11 @@ namespace cocos2d
         };
 
         //static fields
-        std::shared_ptr<Helper> Helper::__sCacheHelper;
+        std::vector<std::shared_ptr<Helper>> Helper::__sCacheHelpers;
         std::mutex Helper::__sCacheHelperMutex;
+        std::atomic<size_t> WebSocketImpl::_netThreadCount{ 1 };
+        std::atomic<WebSocket::ShardPolicy> WebSocketImpl::_shardPolicy{ WebSocket::ShardPolicy::LEAST_LOADED };
+        std::atomic<int64_t> WebSocketImpl::_netIdleLinger{ 0 };
 
         Helper::Helper()
         {}
@@ -191,24 +546,105 @@ namespace cocos2d
             }
         }
 
-        std::shared_ptr<Helper> Helper::fetch()
+        std::shared_ptr<Helper> Helper::fetch(int64_t wsId)
         {
             std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
-            if (!__sCacheHelper)
+            size_t count = std::max<size_t>(1, WebSocketImpl::_netThreadCount.load());
+            if (__sCacheHelpers.size() < count)
+                __sCacheHelpers.resize(count);
+
+            size_t shard = 0;
+            if (WebSocketImpl::_shardPolicy.load() == WebSocket::ShardPolicy::HASH)
+            {
+                shard = std::hash<int64_t>()(wsId) % count;
+            }
+            else
             {
-                __sCacheHelper = std::make_shared<Helper>();
-                __sCacheHelper->init();
+                //an idle slot counts as zero connections, so the threads fill up before any doubles up
+                int least = INT_MAX;
+                for (size_t i = 0; i < count; i++)
+                {
+                    int load = __sCacheHelpers[i] ? __sCacheHelpers[i]->_connections : 0;
+                    if (load < least)
+                    {
+                        least = load;
+                        shard = i;
+                    }
+                }
             }
-            return __sCacheHelper;
+
+            //a lingering idle thread is reused here, its timer sees the new connection and lets it live
+            auto &helper = slotAt(shard);
+            helper->_connections++;
+            return helper;
         }
 
-        void Helper::drop()
+        std::shared_ptr<Helper> &Helper::slotAt(size_t shard)
+        {
+            auto &helper = __sCacheHelpers[shard];
+            if (!helper)
+            {
+                helper = std::make_shared<Helper>();
+                helper->_shard = shard;
+                helper->init();
+            }
+            return helper;
+        }
+
+        void Helper::prewarm()
+        {
+            std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
+            size_t count = std::max<size_t>(1, WebSocketImpl::_netThreadCount.load());
+            if (__sCacheHelpers.size() < count)
+                __sCacheHelpers.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                bool started = !__sCacheHelpers[i];
+                auto &helper = slotAt(i);
+                //with a finite linger an unused thread goes away again, a zero linger keeps it until first use
+                if (started && WebSocketImpl::_netIdleLinger.load() > 0)
+                    helper->send(NetCmd(nullptr, NetCmdType::IDLE, nullptr));
+            }
+        }
+
+        void Helper::drop(const std::shared_ptr<Helper> &helper)
         {
-            // drop ~ _netThread#stop  ~ Helper::after() ~ reset() ~ Helper::~Helper
             std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
-            if (__sCacheHelper)
-                __sCacheHelper->_looper->asyncStop();
+            if (--helper->_connections > 0) return;
+
+            if (WebSocketImpl::_netIdleLinger.load() > 0)
+            {
+                //keep thread, loop and lws context warm for a reconnect, the timer decides
+                helper->send(NetCmd(nullptr, NetCmdType::IDLE, nullptr));
+                return;
+            }
+            retire(helper);
+        }
+
+        void Helper::retire(const std::shared_ptr<Helper> &helper)
+        {
+            // retire ~ _netThread#stop  ~ Helper::after() ~ reset() ~ Helper::~Helper
+            //no active websocket on this thread, take it out of the pool so new connections start a fresh one
+            auto &slot = __sCacheHelpers[helper->_shard];
+            if (slot == helper)
+            {
+                helper->_self = helper;
+                slot.reset();
+            }
+            helper->_looper->asyncStop();
+        }
 
+        void Helper::startIdleTimer()
+        {
+            //restarts the countdown if it is already running
+            uv_timer_start(&_idleTimer, [](uv_timer_t *handle) {
+                Helper *helper = (Helper*)handle->data;
+                std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
+                if (helper->_connections > 0) return;
+                auto self = __sCacheHelpers[helper->_shard];
+                if (self.get() == helper)
+                    retire(self);
+            }, (uint64_t)WebSocketImpl::_netIdleLinger.load(), 0);
         }
 
         void Helper::init()
@@ -221,15 +657,29 @@ namespace cocos2d
             lws_context_creation_info  info = initCtxCreateInfo(_lwsDefaultProtocols, true);
             _lwsContext = lws_create_context(&info);
 
-            _looper->on("open", [this](NetCmd &ev) {this->handleCmdConnect(ev); });
-            _looper->on("send", [this](NetCmd &ev) {this->handleCmdWrite(ev); });
-            _looper->on("close", [this](NetCmd& ev) {this->handleCmdDisconnect(ev); });
-
             _looper->run();
         }
 
         void Helper::clear()
         {
+            _loopThread.store(std::thread::id());
+            //no producer may touch _cmdAsync once it is closed
+            bool asyncInited = _cmdAsyncReady.exchange(false);
+            while (_cmdSenders.load() > 0) std::this_thread::yield();
+            //commands that arrived after the last wakeup never run, release the connections they hold
+            NetCmd late;
+            while (_cmdQueue.pop(late)) {}
+            if (asyncInited)
+            {
+                //the handles live in this Helper, the last close callback releases it
+                _pendingCloses = 3;
+                uv_close((uv_handle_t*)&_cmdAsync, &Helper::onHandleClosed);
+                uv_check_stop(&_batchCheck);
+                uv_close((uv_handle_t*)&_batchCheck, &Helper::onHandleClosed);
+                uv_timer_stop(&_idleTimer);
+                uv_close((uv_handle_t*)&_idleTimer, &Helper::onHandleClosed);
+            }
+
             if (_lwsContext)
             {
                 lws_libuv_stop(_lwsContext);
@@ -246,9 +696,27 @@ namespace cocos2d
                 //so 
                 _looper->asyncStop(); //use async?
             }
-            //delete helper after thread stop
-            std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
-            if (__sCacheHelper) __sCacheHelper.reset();
+            if (!asyncInited)
+                release();
+        }
+
+        void Helper::onHandleClosed(uv_handle_t *handle)
+        {
+            Helper *helper = (Helper*)handle->data;
+            if (--helper->_pendingCloses == 0)
+                helper->release();
+        }
+
+        void Helper::release()
+        {
+            //delete helper after thread stop, outside the lock: these may be the last references
+            std::shared_ptr<Helper> slot, self;
+            {
+                std::lock_guard<std::mutex> guard(__sCacheHelperMutex);
+                if (_shard < __sCacheHelpers.size() && __sCacheHelpers[_shard].get() == this)
+                    slot.swap(__sCacheHelpers[_shard]);
+                self.swap(_self);
+            }
         }
 
         void Helper::initProtocols()
@@ -284,35 +752,116 @@ namespace cocos2d
             return info;
         }
 
-        void Helper::send(const std::string &event, const NetCmd &cmd)
+        void Helper::send(NetCmd &&cmd)
+        {
+            //a delegate running on this loop (UIDispatcher::Mode::INLINE) sends without a queue hop;
+            //the socket still writes from its WRITEABLE callback, as lws expects
+            if (cmd.cmd == NetCmdType::WRITE && isLoopThread()
+                && cmd.ws->_wsi && cmd.ws->_state == WebSocket::State::OPEN)
+            {
+                handleCmdWrite(cmd);
+                return;
+            }
+            _cmdQueue.push(std::move(cmd));
+            //before HelperLoop::before() the queue is drained right after _cmdAsync is set up
+            _cmdSenders.fetch_add(1);
+            if (_cmdAsyncReady.load())
+                uv_async_send(&_cmdAsync);
+            _cmdSenders.fetch_sub(1);
+        }
+
+        void Helper::dispatchCmds()
         {
-            NetCmd _copy(cmd);
-            _looper->emit(event, _copy);
+            NetCmd cmd;
+            while (_cmdQueue.pop(cmd))
+            {
+                switch (cmd.cmd)
+                {
+                case NetCmdType::OPEN:
+                    handleCmdConnect(cmd);
+                    break;
+                case NetCmdType::WRITE:
+                    handleCmdWrite(cmd);
+                    break;
+                case NetCmdType::CLOSE:
+                    handleCmdDisconnect(cmd);
+                    break;
+                case NetCmdType::RESUME_RECEIVE:
+                    cmd.ws->doResumeReceive();
+                    break;
+                case NetCmdType::RESUME_SEND:
+                    cmd.ws->doResumeStream();
+                    break;
+                case NetCmdType::IDLE:
+                    startIdleTimer();
+                    break;
+                default:
+                    break;
+                }
+                cmd.ws.reset();
+                cmd.data.reset();
+                cmd.batch.reset();
+            }
         }
 
 
-        void Helper::runInUI(const std::function<void()> &fn)
+        void Helper::runInUI(Task &&task)
         {
-            //TODO dispatch to main thread
-            fn();
+            //never blocks, the application drains the queue on its own thread
+            UIDispatcher::getInstance().post(std::move(task));
+        }
+
+        void Helper::queueReceiveBatch(WebSocketImpl *ws)
+        {
+            _pendingReceiveBatches.push_back(ws);
+        }
+
+        void Helper::removeReceiveBatch(WebSocketImpl *ws)
+        {
+            _pendingReceiveBatches.erase(std::remove(_pendingReceiveBatches.begin(), _pendingReceiveBatches.end(), ws), _pendingReceiveBatches.end());
+        }
+
+        void Helper::flushReceiveBatches()
+        {
+            for (auto *ws : _pendingReceiveBatches)
+                ws->flushReceiveBatch();
+            _pendingReceiveBatches.clear();
         }
 
         void Helper::handleCmdConnect(NetCmd &cmd)
         {
+            uv_timer_stop(&_idleTimer);
             cmd.ws->doConnect();
         }
 
         void Helper::handleCmdDisconnect(NetCmd &cmd)
         {
             cmd.ws->doDisconnect();
-            //lws_callback_on_writable(cmd.ws->_wsi);
         }
 
         void Helper::handleCmdWrite(NetCmd &cmd)
         {
-            auto pack = cmd.data;
-            cmd.ws->_sendBuffer.push_back(pack);
-            lws_callback_on_writable(cmd.ws->_wsi);
+            WebSocketImpl *ws = cmd.ws.get();
+            //sent after the close: nothing will ever write it, report it dropped right away
+            bool closed = (ws->_state == WebSocket::State::CLOSED);
+            if (cmd.batch)
+            {
+                auto &batch = cmd.batch;
+                for (size_t i = 0; i < batch->count(); i++)
+                {
+                    auto pack = std::allocate_shared<NetDataPack>(PoolAllocator<NetDataPack>(), batch, i);
+                    if (closed) ws->dropPack(*pack);
+                    else ws->enqueuePack(pack);
+                }
+            }
+            else
+            {
+                if (closed) ws->dropPack(*cmd.data);
+                else ws->enqueuePack(cmd.data);
+            }
+            //before the handshake completes netOnConnected asks for the first writable callback
+            if (!closed && ws->_wsi)
+                lws_callback_on_writable(ws->_wsi);
         }
 
         void Helper::updateLibUV()
@@ -326,6 +875,25 @@ namespace cocos2d
         {
             std::cout << "[HelperLoop] thread start ... " << std::endl;
             _helper->updateLibUV();
+
+            uv_async_init(_helper->getUVLoop(), &_helper->_cmdAsync, [](uv_async_t *handle) {
+                ((Helper*)handle->data)->dispatchCmds();
+            });
+            _helper->_cmdAsync.data = _helper;
+
+            uv_check_init(_helper->getUVLoop(), &_helper->_batchCheck);
+            _helper->_batchCheck.data = _helper;
+            uv_check_start(&_helper->_batchCheck, [](uv_check_t *handle) {
+                ((Helper*)handle->data)->flushReceiveBatches();
+            });
+
+            uv_timer_init(_helper->getUVLoop(), &_helper->_idleTimer);
+            _helper->_idleTimer.data = _helper;
+
+            _helper->_loopThread.store(std::this_thread::get_id());
+            _helper->_cmdAsyncReady.store(true);
+            //pick up commands queued before the loop started
+            _helper->dispatchCmds();
         }
 
         void HelperLoop::update(int dtms)
@@ -346,25 +914,36 @@ namespace cocos2d
 
         int WebSocketImpl::_protocolCounter = 1;
         std::atomic_int64_t WebSocketImpl::_wsIdCounter = 1;
-        std::unordered_map<int64_t, WebSocketImpl::Ptr > WebSocketImpl::_cachedSocketes;
+        ConnectionRegistry<WebSocketImpl> WebSocketImpl::_cachedSocketes;
+        std::atomic<size_t> WebSocketImpl::_receiveMemoryUsed{ 0 };
+        std::atomic<size_t> WebSocketImpl::_receiveMemoryBudget{ SIZE_MAX };
 
         ///////friend function 
         static WebSocketImpl::Ptr findWs(int64_t wsId)
         {
-            auto it = WebSocketImpl::_cachedSocketes.find(wsId);
-            return it == WebSocketImpl::_cachedSocketes.end() ? nullptr : it->second;
+            return WebSocketImpl::_cachedSocketes.find(wsId);
         }
 
         WebSocketImpl::WebSocketImpl(WebSocket *t)
         {
             _ws = t;
             _wsId = _wsIdCounter.fetch_add(1);
+            _closed = _closedPromise.get_future().share();
         }
 
         WebSocketImpl::~WebSocketImpl()
         {
             _cachedSocketes.erase(_wsId); //redundancy
 
+            if (_receiveBlock) {
+                unchargeReceive(_receiveBlock->size);
+                NetRecvBlock::release(_receiveBlock);
+                _receiveBlock = nullptr;
+            }
+            for (auto *block : _receiveBatch)
+                NetRecvBlock::release(block);
+            _receiveBatch.clear();
+
             if (_lwsProtocols) {
                 free(_lwsProtocols);
                 _lwsProtocols = nullptr;
@@ -382,8 +961,12 @@ namespace cocos2d
 
         bool WebSocketImpl::init(const std::string &uri, WebSocketDelegate::Ptr delegate, const std::vector<std::string> &protocols, const std::string & caFile)
         {
-            _helper = Helper::fetch();
-            _cachedSocketes.emplace(_wsId, shared_from_this());
+            //reject before taking a net thread slot or a registry entry, nothing to roll back
+            if (uri.empty())
+                return false;
+
+            _helper = Helper::fetch(_wsId);
+            _cachedSocketes.insert(_wsId, shared_from_this());
 
             _uri = uri;
             _delegate = delegate;
@@ -391,9 +974,6 @@ namespace cocos2d
             _caFile = caFile;
             _callbackInvokeFlags = 0;
 
-            if (_uri.size())
-                return false;
-
             size_t size = protocols.size();
             if (size > 0)
             {
@@ -412,35 +992,300 @@ namespace cocos2d
                 }
             }
 
-            _helper->send("open", NetCmd::Open(this));
+            _helper->send(NetCmd::Open(this));
 
             return true;
         }
 
+        void WebSocketImpl::prewarm()
+        {
+            Helper::prewarm();
+        }
+
         void WebSocketImpl::sigClose()
         {
-            _helper->send("close", NetCmd::Close(this));
+            //never connected, nothing to hand to a net thread
+            if (!_helper) return;
+            if (_state != WebSocket::State::CLOSED)
+                _helper->send(NetCmd::Close(this));
+        }
+
+        std::shared_future<void> WebSocketImpl::sigCloseAsync()
+        {
+            if (!_helper)
+            {
+                //never connected, there is no netOnClosed to wait for
+                WebSocket::State expected = WebSocket::State::CONNECTING;
+                if (_state.compare_exchange_strong(expected, WebSocket::State::CLOSED))
+                    _closedPromise.set_value();
+            }
+            sigClose();
+            return _closed;
+        }
+
+        WebSocket::SendResult WebSocketImpl::sigSend(const char *data, size_t len, bool isBinary, const WebSocket::SendOptions &options)
+        {
+            if (!isBinary && _validateSendUtf8.load() && !isValidUtf8((const uint8_t*)data, len))
+                return WebSocket::SendResult::INVALID_UTF8;
+            if (!admitSend(len)) return WebSocket::SendResult::WOULD_BLOCK;
+            _helper->send(NetCmd::Write(this, data, len, isBinary, options));
+            return WebSocket::SendResult::OK;
+        }
+
+        WebSocket::SendResult WebSocketImpl::sigSend(WebSocket::SendBuffer &&buffer, bool isBinary, const WebSocket::SendOptions &options)
+        {
+            if (buffer.empty()) return WebSocket::SendResult::OK;
+            if (!isBinary && _validateSendUtf8.load() && !isValidUtf8(buffer.data(), buffer.size()))
+                return WebSocket::SendResult::INVALID_UTF8;
+            if (!admitSend(buffer.size())) return WebSocket::SendResult::WOULD_BLOCK;
+            _helper->send(NetCmd::Write(this, std::move(buffer), isBinary, options));
+            return WebSocket::SendResult::OK;
+        }
+
+        WebSocket::SendResult WebSocketImpl::sigSendStream(WebSocket::StreamSource &&source, bool isBinary, const WebSocket::SendOptions &options)
+        {
+            if (!source) return WebSocket::SendResult::OK;
+            //chunks are added to _bufferedAmount as they are pulled
+            if (!admitSend(0)) return WebSocket::SendResult::WOULD_BLOCK;
+            auto pack = std::allocate_shared<NetDataPack>(PoolAllocator<NetDataPack>(), std::move(source), isBinary, options);
+            _helper->send(NetCmd(this, NetCmdType::WRITE, pack));
+            return WebSocket::SendResult::OK;
+        }
+
+        WebSocket::SendResult WebSocketImpl::sigSendBatch(const WebSocket::BatchEntry *entries, size_t count, WebSocket::Priority priority)
+        {
+            if (count == 0) return WebSocket::SendResult::OK;
+            size_t total = 0;
+            bool validate = _validateSendUtf8.load();
+            for (size_t i = 0; i < count; i++)
+            {
+                if (validate && !entries[i].isBinary && !isValidUtf8((const uint8_t*)entries[i].data, entries[i].len))
+                    return WebSocket::SendResult::INVALID_UTF8;
+                total += entries[i].len;
+            }
+            if (!admitSend(total)) return WebSocket::SendResult::WOULD_BLOCK;
+            _helper->send(NetCmd::WriteBatch(this, entries, count, priority));
+            return WebSocket::SendResult::OK;
+        }
+
+        void WebSocketImpl::sigResumeStream()
+        {
+            //one command in flight is enough, it polls the source after clearing the flag
+            if (!_helper || _streamResumePending.exchange(true)) return;
+            _helper->send(NetCmd(this, NetCmdType::RESUME_SEND, nullptr));
+        }
+
+        void WebSocketImpl::doResumeStream()
+        {
+            _streamResumePending.store(false);
+            _streamStarved = false;
+            if (_wsi && _state == WebSocket::State::OPEN && hasPendingPacks())
+                lws_callback_on_writable(_wsi);
+        }
+
+        void WebSocketImpl::setReceiveFlowControl(size_t pauseAbove, size_t resumeBelow)
+        {
+            _rxPauseAbove.store(pauseAbove);
+            _rxResumeBelow.store(resumeBelow < pauseAbove ? resumeBelow : pauseAbove);
+        }
+
+        void WebSocketImpl::trackUndelivered(size_t len)
+        {
+            //net thread, just before a received block is passed to runInUI
+            size_t pending = _undeliveredBytes.fetch_add(len) + len;
+            if (pending <= _rxPauseAbove.load() || _rxPaused.load()) return;
+
+            _rxPaused.store(true);
+            lws_rx_flow_control(_wsi, 0);
+            //the consumer may have caught up before it could see _rxPaused
+            if (_undeliveredBytes.load() <= _rxResumeBelow.load())
+                doResumeReceive();
+        }
+
+        void WebSocketImpl::onDelivered(size_t len)
+        {
+            //delegate thread, after the delegate returned
+            unchargeReceive(len);
+            size_t pending = _undeliveredBytes.fetch_sub(len) - len;
+            if (pending > _rxResumeBelow.load() || !_rxPaused.load()) return;
+            //a closed socket reads nothing more
+            if (_state == WebSocket::State::CLOSED || _rxResumePending.exchange(true)) return;
+            _helper->send(NetCmd(this, NetCmdType::RESUME_RECEIVE, nullptr));
+        }
+
+        void WebSocketImpl::doResumeReceive()
+        {
+            _rxResumePending.store(false);
+            if (!_rxPaused.load() || _undeliveredBytes.load() > _rxResumeBelow.load()) return;
+            _rxPaused.store(false);
+            if (_wsi && _state != WebSocket::State::CLOSED)
+                lws_rx_flow_control(_wsi, 1);
+        }
+
+        bool WebSocketImpl::chargeReceive(size_t len)
+        {
+            //net threads, before a chunk is copied
+            size_t used = _receiveMemoryUsed.fetch_add(len) + len;
+            if (used <= _receiveMemoryBudget.load()) return true;
+            _receiveMemoryUsed.fetch_sub(len);
+            return false;
+        }
+
+        void WebSocketImpl::unchargeReceive(size_t len)
+        {
+            _receiveMemoryUsed.fetch_sub(len);
+        }
+
+        int WebSocketImpl::failReceive(NetRecvBlock *block, int status, const char *reason)
+        {
+            //drops `block` and any partly assembled message, both already charged
+            if (block)
+            {
+                unchargeReceive(block->size);
+                NetRecvBlock::release(block);
+            }
+            if (_receiveBlock)
+            {
+                unchargeReceive(_receiveBlock->size);
+                NetRecvBlock::release(_receiveBlock);
+                _receiveBlock = nullptr;
+            }
+            _receiveOpen = false;
+            _receiveMessageSize = 0;
+            _receiveUtf8.reset();
+            lwsl_warn("%s, closing\n", reason);
+            lws_close_reason(_wsi, (enum lws_close_status)status, nullptr, 0);
+            _state = WebSocket::State::CLOSING;
+            return -1;
+        }
+
+        void WebSocketImpl::setBufferWatermarks(size_t high, size_t low)
+        {
+            _highWatermark.store(high);
+            _lowWatermark.store(low < high ? low : high);
+        }
+
+        bool WebSocketImpl::admitSend(size_t len)
+        {
+            const size_t high = _highWatermark.load();
+            if (_bufferedAmount.load() >= high)
+            {
+                //arm onDrain before looking again, so a concurrent drain on the net thread can't miss it
+                _drainPending.store(true);
+                if (_bufferedAmount.load() >= high)
+                    return false;
+            }
+            _bufferedAmount.fetch_add(len);
+            return true;
+        }
+
+        void WebSocketImpl::checkDrain()
+        {
+            if (_bufferedAmount.load() > _lowWatermark.load()) return;
+            if (!_drainPending.exchange(false)) return;
+            auto self = shared_from_this();
+            _helper->runInUI([self]() {
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onDrain(*ws);
+            });
+        }
+
+        void WebSocketImpl::enqueuePack(const std::shared_ptr<NetDataPack> &pack)
+        {
+            int lane = pack->priority();
+            if (lane < 0 || lane >= WS_SEND_PRIORITY_COUNT) lane = static_cast<int>(WebSocket::Priority::NORMAL);
+
+            if (!pack->key().empty())
+            {
+                auto found = _conflated.find(pack->key());
+                if (found != _conflated.end())
+                {
+                    //the older message hasn't been started, take over its queue position.
+                    //settle the slot before reporting: an INLINE onComplete may send on this key again
+                    auto &slot = *found->second.it;
+                    auto replaced = slot;
+                    slot = pack;
+                    _bufferedAmount.fetch_sub(replaced->remain());
+                    completePack(*replaced, WebSocket::SendCompletion::Status::REPLACED);
+                    checkDrain();
+                    return;
+                }
+                _sendBuffer[lane].push_back(pack);
+                _conflated[pack->key()] = ConflatedSlot{ lane, std::prev(_sendBuffer[lane].end()) };
+                return;
+            }
+
+            _sendBuffer[lane].push_back(pack);
+        }
+
+        void WebSocketImpl::completePack(NetDataPack &pack, WebSocket::SendCompletion::Status status)
+        {
+            if (!pack.callback()) return;
+            WebSocket::SendCompletion info;
+            info.status = status;
+            info.len = pack.size();
+            info.enqueuedAt = pack.enqueuedAt();
+            info.writtenAt = std::chrono::steady_clock::now();
+            auto cb = std::move(pack.callback());
+            pack.callback() = nullptr;
+            _helper->runInUI([cb, info]() {
+                cb(info);
+            });
         }
 
-        void WebSocketImpl::sigCloseAsync()
+        void WebSocketImpl::dropPendingPacks()
         {
-            _helper->send("close", NetCmd::Close(this));
-            //sleep forever
-            while (_state != WebSocket::State::CLOSED)
+            if (_sendingPack && !_sendingPack->finished())
+                dropPack(*_sendingPack);
+            _sendingPack.reset();
+            for (auto &lane : _sendBuffer)
             {
-                std::this_thread::yield();
+                for (auto &pack : lane)
+                    dropPack(*pack);
+                lane.clear();
             }
+            _conflated.clear();
         }
 
-        void WebSocketImpl::sigSend(const char *data, size_t len)
+        void WebSocketImpl::dropPack(NetDataPack &pack)
         {
-            _helper->send("send", NetCmd::Write(this, data, len, true));
+            _bufferedAmount.fetch_sub(pack.remain());
+            completePack(pack, WebSocket::SendCompletion::Status::DROPPED);
         }
 
-        void WebSocketImpl::sigSend(const std::string &msg)
+        bool WebSocketImpl::nextPack()
         {
-            NetCmd cmd = NetCmd::Write(this, msg.data(), msg.length(), false);
-            _helper->send("send", cmd);
+            //frames of one message can't be interleaved with another, so lanes are only
+            //switched once the message on the wire is complete
+            if (_sendingPack && !_sendingPack->finished()) return true;
+            _sendingPack.reset();
+            for (int i = 0; i < WS_SEND_PRIORITY_COUNT; i++)
+            {
+                auto &lane = _sendBuffer[i];
+                while (!lane.empty())
+                {
+                    auto pack = lane.front();
+                    if (!pack->key().empty())
+                    {
+                        //started messages can no longer be replaced
+                        auto found = _conflated.find(pack->key());
+                        if (found != _conflated.end() && found->second.lane == i && found->second.it == lane.begin())
+                            _conflated.erase(found);
+                    }
+                    lane.pop_front();
+                    _sendingPack = pack;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool WebSocketImpl::hasPendingPacks() const
+        {
+            if (_sendingPack && !_sendingPack->finished()) return true;
+            for (auto &lane : _sendBuffer)
+                if (!lane.empty()) return true;
+            return false;
         }
 
         int WebSocketImpl::lwsCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, ssize_t len)
@@ -504,7 +1349,18 @@ namespace cocos2d
             { nullptr,nullptr,nullptr }
             };
 
-            auto useSSL = true; //TODO calculate from url
+            //lws_parse_uri cuts the string in place, the pieces must live until the connect call returns
+            std::string uri = _uri;
+            const char *scheme = nullptr, *address = nullptr, *uriPath = nullptr;
+            int port = 0;
+            if (lws_parse_uri(&uri[0], &scheme, &address, &port, &uriPath))
+            {
+                netOnError(WebSocket::ErrorCode::LWS_ERROR);
+                netOnClosed();
+                return;
+            }
+            std::string path = std::string("/") + uriPath;
+            auto useSSL = (strcmp(scheme, "wss") == 0 || strcmp(scheme, "https") == 0);
 
             if (useSSL) {
                 //caFile must be provided once ssl is enabled.
@@ -545,12 +1401,12 @@ namespace cocos2d
             struct lws_client_connect_info cinfo;
             memset(&cinfo, 0, sizeof(cinfo));
             cinfo.context = _helper->_lwsContext;
-            cinfo.address = "invoke.top";
-            cinfo.port = 6789;
+            cinfo.address = address;
+            cinfo.port = port;
             cinfo.ssl_connection = sslFlags;
-            cinfo.path = "/";
-            cinfo.host = "invoke.top";
-            cinfo.origin = "invoke.top";
+            cinfo.path = path.c_str();
+            cinfo.host = address;
+            cinfo.origin = address;
             cinfo.protocol = _joinedProtocols.empty() ? "" : _joinedProtocols.c_str();
             cinfo.ietf_version_or_minus_one = -1;
             cinfo.userdata = this;
@@ -560,7 +1416,12 @@ namespace cocos2d
             _wsi = lws_client_connect_via_info(&cinfo);
 
             if (_wsi == nullptr)
+            {
                 netOnError(WebSocket::ErrorCode::LWS_ERROR);
+                //lws never created a wsi, so no WSI_DESTROY will follow
+                netOnClosed();
+                return;
+            }
 
             _helper->updateLibUV();
         }
@@ -568,11 +1429,43 @@ namespace cocos2d
         void WebSocketImpl::doDisconnect()
         {
             if (_state == WebSocket::State::CLOSED) return;
-            _state = WebSocket::State::CLOSING;
+            if (!_wsi)
+            {
+                //no wsi to wait for, finish the close here so closeAsync() waiters wake
+                netOnClosed();
+                return;
+            }
+
+            if (_state == WebSocket::State::CONNECTING)
+            {
+                //no writable callback before the handshake completes, have lws drop the wsi on its next service.
+                //the reason must not be NO_PENDING_TIMEOUT, that one cancels the timeout instead
+                _state = WebSocket::State::CLOSING;
+                lws_set_timeout(_wsi, PENDING_TIMEOUT_USER_REASON_BASE, LWS_TO_KILL_ASYNC);
+                return;
+            }
+
+            //netOnWritable sees CLOSING and returns -1, lws sends the close frame with this reason;
+            //a close already under way keeps the reason it was started with
+            if (_state != WebSocket::State::CLOSING)
+            {
+                _state = WebSocket::State::CLOSING;
+                lws_close_reason(_wsi, LWS_CLOSE_STATUS_NORMAL, nullptr, 0);
+            }
+            lws_callback_on_writable(_wsi);
         }
 
-        void WebSocketImpl::doWrite(NetDataPack &pack)
+        int WebSocketImpl::doWrite(NetDataPack &pack)
         {
+            if (pack.remain() == 0 && !pack.lastChunk())
+            {
+                size_t n = pack.pull();
+                _bufferedAmount.fetch_add(n);
+                //source has nothing yet, try again on the next writable callback
+                if (n == 0 && !pack.lastChunk())
+                    return 0;
+            }
+
             const size_t bufferSize = WS_RX_BUFFER_SIZE;
             const size_t frameSize = bufferSize > pack.remain() ? pack.remain() : bufferSize; //min
 
@@ -582,20 +1475,26 @@ namespace cocos2d
             else
                 writeProtocol |= LWS_WRITE_CONTINUATION;
 
-            if (frameSize < pack.remain())
+            if (frameSize < pack.remain() || !pack.lastChunk())
                 writeProtocol |= LWS_WRITE_NO_FIN;
 
-            size_t bytesWrite = lws_write(_wsi, pack.payload(), frameSize, (lws_write_protocol)writeProtocol);
+            int bytesWrite = lws_write(_wsi, pack.payload(), frameSize, (lws_write_protocol)writeProtocol);
 
             if (bytesWrite < 0)
             {
-                //error 
-                sigCloseAsync();
+                //error, the caller closes the connection by returning -1 to lws
+                _state = WebSocket::State::CLOSING;
+                return -1;
             }
-            else
+
+            pack.consume(bytesWrite);
+            _bufferedAmount.fetch_sub(bytesWrite);
+            if (!(writeProtocol & LWS_WRITE_NO_FIN))
             {
-                pack.consume(bytesWrite);
+                pack.finish();
+                completePack(pack, WebSocket::SendCompletion::Status::SENT);
             }
+            return bytesWrite;
         }
 
         int WebSocketImpl::netOnError(WebSocket::ErrorCode ecode)
@@ -604,8 +1503,10 @@ namespace cocos2d
 
             auto code = static_cast<int>(ecode);
             std::cout << "connection error: " << code << std::endl;
-            _helper->runInUI([this, code]() {
-                this->_delegate->onError(*(this->_ws), static_cast<int>(code)); //FIXME error code
+            auto self = shared_from_this();
+            _helper->runInUI([self, code]() {
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onError(*ws, static_cast<int>(code)); //FIXME error code
             });
 
             //change state to CLOSED
@@ -618,12 +1519,17 @@ namespace cocos2d
         {
             CHECK_INVOKE_FLAG(CallbackInvoke_CONNECTED);
             std::cout << "connected!" << std::endl;
+            //close() was called during the handshake
+            if (_state == WebSocket::State::CLOSING)
+                return -1;
             _state = WebSocket::State::OPEN;
-            auto wsi = this->_wsi;
-            _helper->runInUI([this, wsi]() {
-                this->_delegate->onConnected(*(this->_ws));
-                lws_callback_on_writable(wsi);
+            auto self = shared_from_this();
+            _helper->runInUI([self]() {
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onConnected(*ws);
             });
+            //lws is only touched on the net thread, flush whatever was queued before the handshake finished
+            lws_callback_on_writable(_wsi);
             return 0;
         }
 
@@ -631,20 +1537,33 @@ namespace cocos2d
         {
             CHECK_INVOKE_FLAG(CallbackInvoke_CLOSED);
             _state = WebSocket::State::CLOSED;
-            auto self = shared_from_this();
-            auto wsid = _wsId;
-            _helper->runInUI([self, wsid]() {
-                //remove from cache in UI thread, since it's added in main thread
-                _cachedSocketes.erase(wsid);
-                self->_delegate->onDisconnected(*(self->_ws));
-            });
-
-
-            if (_cachedSocketes.size() == 0)
+            //lws frees the wsi once this callback returns
+            _wsi = nullptr;
+            //wake closeAndWait/closeAsync callers, the delegate still hears onDisconnected through runInUI
+            _closedPromise.set_value();
+            dropPendingPacks();
+            //a message cut off by the close is never delivered, give its bytes back to the budget now
+            if (_receiveBlock)
+            {
+                unchargeReceive(_receiveBlock->size);
+                NetRecvBlock::release(_receiveBlock);
+                _receiveBlock = nullptr;
+            }
+            //messages received before the close go out ahead of onDisconnected
+            if (_receiveBatchQueued)
             {
-                //no active websocket, quit netThread
-                Helper::drop();
+                _helper->removeReceiveBatch(this);
+                flushReceiveBatch();
             }
+            //the registry is thread-safe, unregister right away so connectionCount() doesn't lag the UI queue
+            auto self = shared_from_this();
+            _cachedSocketes.erase(_wsId);
+            _helper->runInUI([self]() {
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onDisconnected(*ws);
+            });
+            //the count lives on the Helper, thread retirement and shard load must not wait for the application to drain UIDispatcher
+            Helper::drop(_helper);
 
             return 0;
         }
@@ -652,29 +1571,134 @@ namespace cocos2d
         int WebSocketImpl::netOnReadable(void *in, size_t len)
         {
             std::cout << "readable : " << len << std::endl;
-            if (in && len > 0) {
-                _receiveBuffer.insert(_receiveBuffer.end(), (uint8_t*)in, (uint8_t*)in + len);
-            }
 
             auto remainSize = lws_remaining_packet_payload(_wsi);
             auto isFinalFrag = lws_is_final_fragment(_wsi);
+            bool isFirst = !_receiveOpen;
+            bool isFinal = (remainSize == 0 && isFinalFrag);
 
-            if (remainSize == 0 && isFinalFrag)
+            //the delivery mode is latched per message
+            if (isFirst)
             {
-                auto rbuffCopy = std::make_shared<std::vector<uint8_t>>(std::move(_receiveBuffer));
+                _receiveFragmentMode = _fragmentedReceive.load();
+                _receiveMessageSize = 0;
+            }
+            _receiveOpen = !isFinal;
 
-                _receiveBuffer.reserve(WS_REVERSED_RECEIVE_BUFFER_SIZE);
+            //reject as soon as lws knows the frame can't fit, before copying anything
+            _receiveMessageSize += len;
+            if (_receiveMessageSize + remainSize > _maxMessageSize.load())
+                return failReceive(nullptr, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, "message exceeds max message size");
+            if (!chargeReceive(len))
+                return failReceive(nullptr, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, "receive memory budget exhausted");
 
-                bool isBinary = (lws_frame_is_binary(_wsi) != 0);
+            if (_receiveFragmentMode)
+            {
+                //hand each chunk over as it arrives, memory stays bounded by the rx buffer size
+                NetRecvBlock *block = NetRecvBlock::create(len);
+                if (in && len > 0)
+                    block = NetRecvBlock::append(block, in, len);
+                block->isBinary = (lws_frame_is_binary(_wsi) != 0);
+                block->isFirst = isFirst;
+                block->isFinal = isFinal;
+
+                if (!block->isBinary && _validateReceiveUtf8.load())
+                {
+                    if (isFirst) _receiveUtf8.reset();
+                    if (!_receiveUtf8.update(block->data(), block->size) || (isFinal && !_receiveUtf8.finish()))
+                        return failReceive(block, LWS_CLOSE_STATUS_INVALID_PAYLOAD, "invalid utf-8 in text frame");
+                }
 
-                _helper->runInUI([rbuffCopy, this, isBinary]() {
-                    WebSocket::Data data((char*)(rbuffCopy->data()), rbuffCopy->size(), isBinary);
-                    this->_delegate->onMesage(*(this->_ws), data);
+                trackUndelivered(block->size);
+                auto self = shared_from_this();
+                _helper->runInUI([self, block]() {
+                    size_t len = block->size;
+                    WebSocket::Data data((char*)block->data(), block->size, block->isBinary);
+                    data.ext = block;
+                    WebSocket *ws = self->_ws.load();
+                    if (ws) self->_delegate->onMessageFragment(*ws, data, block->isFirst, block->isFinal);
+                    if (!data.isused)
+                        NetRecvBlock::release(block);
+                    self->onDelivered(len);
                 });
+                return 0;
+            }
+
+            if (!_receiveBlock)
+            {
+                //size the first block for the whole frame when lws already knows it, otherwise from what
+                //this connection usually receives; a rare large message no longer inflates every later one
+                //the suggestion is a power of two, leave room for the block header so it stays in that pool class
+                size_t reserve = _receiveSizes.empty() ? WS_REVERSED_RECEIVE_BUFFER_SIZE
+                    : _receiveSizes.suggest(WS_RECEIVE_RESERVE_MIN, WS_RECEIVE_RESERVE_MAX);
+                reserve -= NetRecvBlock::HEADER_SIZE;
+                _receiveBlock = NetRecvBlock::create(std::max<size_t>(len + remainSize, reserve));
+            }
+            if (in && len > 0) {
+                _receiveBlock = NetRecvBlock::append(_receiveBlock, in, len);
+            }
+
+            if (isFinal)
+            {
+                NetRecvBlock *block = _receiveBlock;
+                _receiveBlock = nullptr;
+                block->isBinary = (lws_frame_is_binary(_wsi) != 0);
+                _receiveSizes.add(block->size);
+
+                if (!block->isBinary && _validateReceiveUtf8.load() && !isValidUtf8(block->data(), block->size))
+                    return failReceive(block, LWS_CLOSE_STATUS_INVALID_PAYLOAD, "invalid utf-8 in text frame");
+
+                trackUndelivered(block->size);
+                if (_batchedReceive.load())
+                {
+                    _receiveBatch.push_back(block);
+                    if (!_receiveBatchQueued)
+                    {
+                        _receiveBatchQueued = true;
+                        _helper->queueReceiveBatch(this);
+                    }
+                }
+                else
+                {
+                    deliverMessage(block);
+                }
             }
             return 0;
         }
 
+        void WebSocketImpl::deliverMessage(NetRecvBlock *block)
+        {
+            //the dispatcher owns one reference, it returns the block to the pool unless the delegate retained or detached it
+            auto self = shared_from_this();
+            _helper->runInUI([self, block]() {
+                size_t len = block->size;
+                WebSocket::Data data((char*)block->data(), block->size, block->isBinary);
+                data.ext = block;
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onMesage(*ws, data);
+                if (!data.isused)
+                    NetRecvBlock::release(block);
+                self->onDelivered(len);
+            });
+        }
+
+        void WebSocketImpl::flushReceiveBatch()
+        {
+            _receiveBatchQueued = false;
+            if (_receiveBatch.empty()) return;
+
+            NetRecvBatch *batch = NetRecvBatch::create(_receiveBatch);
+            _receiveBatch.clear();
+            auto self = shared_from_this();
+            _helper->runInUI([self, batch]() {
+                size_t bytes = batch->bytes;
+                WebSocket *ws = self->_ws.load();
+                if (ws) self->_delegate->onMessages(*ws, batch->messages(), batch->count);
+                NetRecvBatch::destroy(batch);
+                self->onDelivered(bytes);
+            });
+        }
+
         int WebSocketImpl::netOnWritable()
         {
             std::cout << "writable" << std::endl;
@@ -686,21 +1710,30 @@ namespace cocos2d
                 return -1;
             }
 
-            //pop sent packs
-            while (_sendBuffer.size() > 0 && _sendBuffer.front()->remain() == 0)
+            //keep writing until the socket would block or the budget is spent,
+            //a partial write leaves lws holding the rest and reports the pipe choked
+            size_t written = 0;
+            _streamStarved = false;
+            while (nextPack())
             {
-                _sendBuffer.pop_front();
-            }
+                if (written > 0 && (written >= WS_WRITE_BUDGET_PER_CALLBACK || lws_send_pipe_choked(_wsi)))
+                    break;
 
-            if (_sendBuffer.size() > 0)
-            {
-                auto &pack = _sendBuffer.front();
-                if (pack->remain() > 0) {
-                    doWrite(*pack);
+                int bytesWrite = doWrite(*_sendingPack);
+                if (bytesWrite < 0)
+                    return -1;
+                if (bytesWrite == 0 && !_sendingPack->finished())
+                {
+                    //the stream has no data yet; re-arming now would spin the loop, resumeStream() wakes us
+                    _streamStarved = true;
+                    break;
                 }
+                written += bytesWrite;
             }
 
-            if (_wsi && _sendBuffer.size() > 0)
+            checkDrain();
+
+            if (_wsi && !_streamStarved && hasPendingPacks())
                 lws_callback_on_writable(_wsi);
 
             return 0;
@@ -1,14 +1,21 @@
 #pragma once
 
 #include <memory>
+#include <list>
 #include <unordered_map>
 #include <vector>
 #include <string>
 #include <atomic>
+#include <cstdint>
 #include <functional>
+#include <future>
 #include <libwebsockets.h>
 
 #include "WebSocket.h"
+#include "Utf8Validator.h"
+#include "ConnectionRegistry.h"
+
+#define WS_SEND_PRIORITY_COUNT 3
 
 namespace cocos2d
 {
@@ -17,6 +24,59 @@ namespace cocos2d
         class NetDataPack;
         class Helper;
 
+        /**
+         * Refcounted pooled buffer a received message is assembled in.
+         * The header sits in front of the bytes inside one BufferPool block.
+         */
+        class NetRecvBlock
+        {
+        public:
+            static NetRecvBlock *create(size_t capacity);
+            static void retain(NetRecvBlock *block);
+            static void release(NetRecvBlock *block);
+            // append `len` bytes, moving to a larger block if needed; returns the block holding the data
+            static NetRecvBlock *append(NetRecvBlock *block, const void *p, size_t len);
+
+            uint8_t *data() { return reinterpret_cast<uint8_t*>(this) + HEADER_SIZE; }
+
+            std::atomic<int> refs;
+            size_t capacity;
+            size_t size;
+            bool isBinary;
+            bool isFirst;   //fragment delivery only
+            bool isFinal;
+
+            static const size_t HEADER_SIZE = 32;
+        };
+
+        /**
+         * Sizes of received messages on one connection: an EWMA plus a log2 histogram whose counts
+         * are halved every DECAY_PERIOD samples, so old outliers fade out.
+         * Used to pick the initial capacity of the next receive block.
+         */
+        class MessageSizeStats
+        {
+        public:
+            MessageSizeStats();
+
+            void add(size_t size);
+            bool empty() const { return _total == 0; }
+            size_t ewma() const { return (size_t)(_ewma >> EWMA_SHIFT); }
+            // upper bound of the histogram bucket holding the given percentile (0-100)
+            size_t percentile(int pct) const;
+            // capacity to reserve for a message of unknown size, between `minSize` and `maxSize`
+            size_t suggest(size_t minSize, size_t maxSize) const;
+
+            static const int BUCKETS = 40;
+            static const int EWMA_SHIFT = 3;    //alpha = 1/8
+            static const uint32_t DECAY_PERIOD = 256;
+        private:
+            uint64_t _ewma = 0;     //fixed point, scaled by 1 << EWMA_SHIFT
+            uint32_t _buckets[BUCKETS];
+            uint32_t _total = 0;
+            uint32_t _sinceDecay = 0;
+        };
+
         class WebSocketImpl : public std::enable_shared_from_this<WebSocketImpl>
         {
         private:
@@ -25,23 +85,42 @@ namespace cocos2d
         public:
             typedef std::shared_ptr<WebSocketImpl> Ptr;
 
-            static std::unordered_map<int64_t, Ptr > _cachedSocketes;
+            static ConnectionRegistry<WebSocketImpl> _cachedSocketes;
+            //received payload bytes held by all connections, see WebSocket::setReceiveMemoryBudget
+            static std::atomic<size_t> _receiveMemoryUsed;
+            static std::atomic<size_t> _receiveMemoryBudget;
+            //net thread pool, see WebSocket::setNetThreadCount
+            static std::atomic<size_t> _netThreadCount;
+            static std::atomic<WebSocket::ShardPolicy> _shardPolicy;
+            static std::atomic<int64_t> _netIdleLinger;    //ms
+            static void prewarm();
 
             WebSocketImpl(WebSocket *);
             virtual ~WebSocketImpl();
 
             bool init(const std::string &uri, WebSocketDelegate::Ptr delegate, const std::vector<std::string> &protocols, const std::string &caFile);
             void sigClose();
-            void sigCloseAsync();
-            void sigSend(const char *data, size_t len);
-            void sigSend(const std::string &msg);
+            std::shared_future<void> sigCloseAsync();
+            WebSocket::SendResult sigSend(const char *data, size_t len, bool isBinary, const WebSocket::SendOptions &options);
+            WebSocket::SendResult sigSend(WebSocket::SendBuffer &&buffer, bool isBinary, const WebSocket::SendOptions &options);
+            WebSocket::SendResult sigSendStream(WebSocket::StreamSource &&source, bool isBinary, const WebSocket::SendOptions &options);
+            void sigResumeStream();
+            WebSocket::SendResult sigSendBatch(const WebSocket::BatchEntry *entries, size_t count, WebSocket::Priority priority);
+
+            size_t bufferedAmount() const { return _bufferedAmount.load(); }
+            void setBufferWatermarks(size_t high, size_t low);
+            void setFragmentedReceive(bool enabled) { _fragmentedReceive.store(enabled); }
+            void setReceiveFlowControl(size_t pauseAbove, size_t resumeBelow);
+            void setBatchedReceive(bool enabled) { _batchedReceive.store(enabled); }
+            void setUtf8Validation(bool onReceive, bool onSend) { _validateReceiveUtf8.store(onReceive); _validateSendUtf8.store(onSend); }
+            void setMaxMessageSize(size_t bytes) { _maxMessageSize.store(bytes); }
 
             int lwsCallback(struct lws *wsi, enum lws_callback_reasons reason, void*, void*, ssize_t);
 
         private:
             void doConnect();
             void doDisconnect();    //callbacks
-            void doWrite(NetDataPack &pack);
+            int doWrite(NetDataPack &pack);
 
             int netOnError(WebSocket::ErrorCode code);
             int netOnConnected();
@@ -49,10 +128,29 @@ namespace cocos2d
             int netOnReadable(void *, size_t len);
             int netOnWritable();
 
+            bool admitSend(size_t len);
+            void checkDrain();
+            void enqueuePack(const std::shared_ptr<NetDataPack> &pack);
+            void completePack(NetDataPack &pack, WebSocket::SendCompletion::Status status);
+            void dropPendingPacks();
+            void dropPack(NetDataPack &pack);
+            void doResumeStream();
+
+            void trackUndelivered(size_t len);
+            void onDelivered(size_t len);
+            void doResumeReceive();
+            bool chargeReceive(size_t len);
+            static void unchargeReceive(size_t len);
+            int failReceive(NetRecvBlock *block, int status, const char *reason);
+            void deliverMessage(NetRecvBlock *block);
+            void flushReceiveBatch();
+            bool nextPack();
+            bool hasPendingPacks() const;
+
         public:
             WebSocketDelegate::Ptr _delegate;
-            WebSocket *_ws = nullptr;
-            WebSocket::State _state;
+            std::atomic<WebSocket*> _ws{ nullptr };   //cleared by ~WebSocket on the application thread
+            std::atomic<WebSocket::State> _state{ WebSocket::State::CONNECTING };
             std::shared_ptr<Helper> _helper;
 
         private:
@@ -60,15 +158,53 @@ namespace cocos2d
             std::string _caFile;
             std::vector<std::string> _protocols;
             std::string _joinedProtocols = "";
-            std::vector<uint8_t> _receiveBuffer;
+            NetRecvBlock *_receiveBlock = nullptr;
+            MessageSizeStats _receiveSizes;
+            std::atomic<bool> _fragmentedReceive{ false };
+            //receive state of the message in progress, net thread only
+            bool _receiveOpen = false;
+            bool _receiveFragmentMode = false;
+            size_t _receiveMessageSize = 0;
+            std::atomic<size_t> _maxMessageSize{ SIZE_MAX };
+            std::atomic<bool> _validateReceiveUtf8{ true };
+            std::atomic<bool> _validateSendUtf8{ false };
+            Utf8Validator _receiveUtf8;     //text validation across chunks in fragment mode
+            std::atomic<bool> _batchedReceive{ false };
+            std::vector<NetRecvBlock*> _receiveBatch;  //completed this poll iteration, flushed by Helper
+            bool _receiveBatchQueued = false;
+            //receive flow control, bytes handed to runInUI but not yet consumed by the delegate
+            std::atomic<size_t> _undeliveredBytes{ 0 };
+            std::atomic<size_t> _rxPauseAbove{ SIZE_MAX };
+            std::atomic<size_t> _rxResumeBelow{ 0 };
+            std::atomic<bool> _rxPaused{ false };
+            std::atomic<bool> _rxResumePending{ false };
+            //a stream source ran dry, writable callbacks stop until resumeStream()
+            bool _streamStarved = false;
+            std::atomic<bool> _streamResumePending{ false };
             //libwebsocket fiels
             lws *_wsi = nullptr;
             lws_vhost *_lwsHost = nullptr;
             lws_protocols *_lwsProtocols = nullptr;
             int64_t _wsId;
-            std::list<std::shared_ptr<NetDataPack>> _sendBuffer;
+            //one FIFO per WebSocket::Priority, _sendingPack is the message currently on the wire
+            std::list<std::shared_ptr<NetDataPack>> _sendBuffer[WS_SEND_PRIORITY_COUNT];
+            std::shared_ptr<NetDataPack> _sendingPack;
+            //queued packs with a conflation key, only packs still waiting in a lane are listed
+            struct ConflatedSlot {
+                int lane;
+                std::list<std::shared_ptr<NetDataPack>>::iterator it;
+            };
+            std::unordered_map<std::string, ConflatedSlot> _conflated;
+            //backpressure, counted in payload bytes not yet written to the socket
+            std::atomic<size_t> _bufferedAmount{ 0 };
+            std::atomic<size_t> _highWatermark{ SIZE_MAX };
+            std::atomic<size_t> _lowWatermark{ 0 };
+            std::atomic<bool> _drainPending{ false };
 
             int32_t _callbackInvokeFlags = 0;
+            //fulfilled by netOnClosed, waited on by closeAsync callers
+            std::promise<void> _closedPromise;
+            std::shared_future<void> _closed;
 
             friend class Helper;
         };
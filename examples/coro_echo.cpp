@@ -0,0 +1,54 @@
+// C++20 coroutine client: connect, send a greeting, print replies until the server closes.
+// built by the coro_echo target, configure with -DWS_BUILD_CORO_EXAMPLE=ON
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+
+#include "WebSocketCoro.h"
+
+using namespace cocos2d::network;
+
+static std::atomic<bool> finished{ false };
+
+static CoTask run(CoWebSocket &ws, std::string uri, std::string caFile)
+{
+    if (!co_await ws.connect(uri, std::vector<std::string>(), caFile))
+    {
+        std::cout << "[coro] connect failed" << std::endl;
+        finished = true;
+        co_return;
+    }
+
+    auto sent = co_await ws.send(std::string("hello plutoo"));
+    std::cout << "[coro] greeting " << (sent.completion.status == WebSocket::SendCompletion::Status::SENT ? "sent" : "dropped") << std::endl;
+
+    for (int i = 0; i < 10; i++)
+    {
+        auto msg = co_await ws.receive();
+        if (msg.closed) break;
+        std::cout << "[coro] received " << msg.payload.size() << " bytes" << std::endl;
+    }
+    //the close completes on the net thread, blocking here does not need drain()
+    ws.socket().closeAndWait(std::chrono::seconds(5));
+    finished = true;
+}
+
+int main(int argc, char **argv)
+{
+    std::string uri = argc > 1 ? argv[1] : "wss://invoke.top:6789/";
+    std::string caFile = argc > 2 ? argv[2] : "cacert.pem";
+
+    CoWebSocket ws(CoExecutor::DISPATCHER);
+    run(ws, uri, caFile);
+
+    //the coroutine resumes on this thread, inside drain()
+    while (!finished)
+    {
+        UIDispatcher::getInstance().drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    }
+    return 0;
+}
@@ -10,6 +10,7 @@
 
 #include "WebSocket.h"
 #include "Looper.h"
+#include "UIDispatcher.h"
 
 using namespace cocos2d::loop;
 using namespace cocos2d::net;
@@ -76,9 +77,15 @@ int main(int argc, char **argv)
     Ticker * ticker = new Ticker(ws);
     strLooper = std::make_shared<LooperString>(ticker, 2000);
 
-    ws->init("", std::make_shared<WSDelegate>(), std::vector<std::string>(), "E:\\Projects\\uv2_cmake\\cacert.pem");
+    ws->init("wss://invoke.top:6789/", std::make_shared<WSDelegate>(), std::vector<std::string>(), "E:\\Projects\\uv2_cmake\\cacert.pem");
     
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    //delegate callbacks are queued for this thread
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < until)
+    {
+        UIDispatcher::getInstance().drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    }
     
 
     //ws->close();